@@ -30,23 +30,23 @@
  * - ArduinoJson.h
  * - Ticker.h
  * - LittleFS.h
- * - ESP8266HTTPClient.h (if NODEMCU is defined)
  * - ESP8266WiFi.h (if NODEMCU is defined)
  * - ESP8266WebServer.h (if NODEMCU is defined)
  * - ESP8266mDNS.h (if WEBSERVER is defined)
  * - ESP8266HTTPUpdateServer.h (if WEBSERVER is defined)
+ * - Hardware.h
  * - Display.h
  * - Configure.h
+ * - Domoticz.h
  *
  * @section Macros
  * - VERSION: Defines the version of the system.
- * - Various macros for configuration settings and hardware dependencies.
+ * - Various macros for configuration settings (hardware dependencies are in Hardware.h).
  *
  * @section Enums
  * - _estados: Defines the different states of the system.
  * - _fases: Defines the different phases of the system.
  * - _flags: Defines various flags used in the system.
- * - _botones: Defines the different buttons used in the system.
  *
  * @section Structures
  * - Grupo_parm: Structure to save a group configuration.
@@ -58,6 +58,7 @@
  * - S_simFlags: Union for simulation flags.
  * - S_BOTON: Structure for button details.
  * - S_Estado: Structure for system state.
+ * - S_VERIFY: Structure for the result of an asynchronous status verification.
  *
  * @section Globals
  * - Various global variables and constants used across the modules.
@@ -86,7 +87,6 @@
   #include <LittleFS.h>
 
   #ifdef NODEMCU
-    #include <ESP8266HTTPClient.h>
     #include <ESP8266WiFi.h>
     #include <ESP8266WebServer.h >
     #ifdef WEBSERVER
@@ -95,8 +95,11 @@
     #endif
   #endif
 
+  #include "Hardware.h"
   #include "Display.h"
   #include "Configure.h"
+  #include "Domoticz.h"
+  #include "DomoMqtt.h"
 
   #ifdef DEVELOP
     //Comportamiento general para PRUEBAS . DESCOMENTAR LO QUE CORRESPONDA
@@ -161,37 +164,26 @@
   #define MAXCONNECTRETRY     10
   #define VERIFY_INTERVAL     15
   #define DEFAULT_SWITCH_RETRIES 5
-  #define DELAYRETRY          2000
-
- //----------------  dependientes del HW   ----------------------------------------
-
-  #ifdef NODEMCU
-    #define ENCCLK                D0
-    #define ENCDT                 D1
-    #define ENCSW                 100
-    #define BUZZER                2
-    #define HC595_DATA            D8
-    #define HC595_LATCH           D4
-    #define HC595_CLOCK           D5
-    #define CD4021B_CLOCK         D5
-    #define CD4021B_LATCH         D6
-    #define CD4021B_DATA          D7
-    #define LEDR                  4
-    #define LEDG                  5
-    #define LEDB                  3 
-    #define lGRUPO1               6
-    #define lGRUPO2               7
-    #define lGRUPO3               8
-    #define lZONA1                10
-    #define lZONA2                11
-    #define lZONA3                12
-    #define lZONA4                13
-    #define lZONA5                14
-    #define lZONA6                15
-    #define lZONA7                16
-  #endif
- //----------------  fin dependientes del HW   ----------------------------------------
-
+  #define SHADOW_MAXAGE       30    // segundos durante los que el estado en la sombra local se da por bueno
+  #define FACTORS_TTL         600   // segundos de validez de los factores de riego leidos de Domoticz
+  #define LEDS_PWMHZ          100   // periodos PWM por segundo de la cadena de LEDs
+  #define LEDS_PWMSTEPS       8     // niveles de brillo (pasos de ledsISR por periodo)
+  #define LEDS_DIMMED         2     // nivel de los LEDs RGB en reposo
+  #define LEDS_ANIMHZ         50    // frames por segundo de las animaciones de los LEDs
+  #define LEDS_ANIMSLOTS      8     // patrones de animacion simultaneos
+  #define INPUTS_SCANHZ       200   // lecturas por segundo de los botones (desde ledsISR)
+  #define INPUTS_QUEUE        16    // eventos de botones en cola (potencia de 2)
+
+
+
+  //Prioridades de las animaciones de los LEDs (la mayor gana sobre un mismo LED)
+  enum _anims {
+    ANIM_ZONA     ,
+    ANIM_ON       ,
+    ANIM_CONF     ,
+    ANIM_WIFI     ,
+    ANIM_AP       ,
+  };
 
   //Para legibilidad del codigo
   #define ON  1
@@ -237,44 +229,12 @@
     HOLD         = 0x20,
   };
 
-  //----------------  dependientes del HW   ----------------------------------------
-  enum _botones {
-    bZONA1      = 0x0001,
-    bZONA2      = 0x0002,
-    bZONA3      = 0x0004,
-    bZONA4      = 0x0008,
-    bZONA6      = 0x0010,
-    bMULTIRIEGO = 0x0020,
-    bZONA7      = 0x0040,
-    bZONA5      = 0x0080,
-    bSPARE13    = 0x0100,
-    bGRUPO3     = 0x0200,
-    bGRUPO1     = 0x0400,
-    bSTOP       = 0x0800,
-    bENCODER    = 0x1000,
-    bSPARE15    = 0x2000,
-    bSPARE16    = 0x4000,
-    bPAUSE      = 0x8000,
-  };
-
-  //Pseudobotones
-  #define bGRUPO2   0xFF01
-  #define bCONFIG   0xFF02
-
-  //----------------  dependientes del HW (número, orden)  ----------------------------
-    // lista de todos los botones de zonas de riego disponibles:
-  #define _ZONAS  bZONA1 , bZONA2 , bZONA3 , bZONA4 , bZONA5 , bZONA6 , bZONA7
-    // lista de todos los botones (selector) de grupos disponibles:
-  #define _GRUPOS bGRUPO1 , bGRUPO2 , bGRUPO3
-  #define _NUMZONAS            7  // numero de zonas (botones riego individual)
-  #define _NUMGRUPOS           3  // numero de grupos multirriego
- //----------------  fin dependientes del HW   ----------------------------------------
-
   //estructura para salvar un grupo
   struct Grupo_parm {
-    uint16_t id;
+    inmask_t id;
+    uint16_t idx = 0;    //idx del grupo equivalente en Domoticz (0: sin grupo)
     int size;
-    uint16_t serie[16];  
+    uint16_t serie[NUMZONAS];  //numeros de zona (1..NUMZONAS)
     char desc[20];
   } ;
 
@@ -287,25 +247,35 @@
   //estructura para parametros configurables
   struct Config_parm {
     uint8_t   initialized=0;
-    static const int  n_Zonas = _NUMZONAS; 
+    static const int  n_Zonas = NUMZONAS; 
     Boton_parm botonConfig[n_Zonas];
     uint8_t   minutes = DEFAULTMINUTES; 
     uint8_t   seconds = DEFAULTSECONDS;
+    uint8_t   solape = 0;       // segundos que la siguiente zona de un multirriego se abre antes de cerrar la actual
     char domoticz_ip[40];
     char domoticz_port[6];
+    uint16_t  shadowMaxAge = SHADOW_MAXAGE;
+    bool      mqtt = false;     // transporte MQTT ademas de HTTP
+    char mqtt_ip[40];           // broker MQTT (vacio: el de domoticz_ip)
+    char mqtt_port[6];
     char ntpServer[40];
-    static const int  n_Grupos = _NUMGRUPOS; 
+    static const int  n_Grupos = NUMGRUPOS; 
     Grupo_parm groupConfig[n_Grupos];
   };
 
   struct S_MULTI {
-    uint16_t *id;        //apuntador al id del selector grupo en estructura config (bGrupo_x)
-    uint16_t serie[16];  //contiene los id de los botones del grupo (bZona_x)
+    inmask_t *id;        //apuntador al id del selector grupo en estructura config (bGrupo_x)
+    inmask_t serie[NUMZONAS];  //contiene los id de los botones del grupo (bZona_x)
     uint16_t *zserie;    //apuntador a config con las zonas del grupo (Zona_x)
     int *size;           //apuntador a config con el tamaño del grupo
     int w_size;          //variable auxiliar durante ConF
     int actual;          //variable auxiliar durante un multirriego 
+    int proxima;         //posicion en serie de la siguiente zona con riego (preparada al iniciar la actual)
+    struct S_BOTON *siguiente;  //boton de la siguiente zona con riego (NULL si no hay)
+    bool solapando;      //la siguiente zona ya se ha abierto (solape)
+    struct S_BOTON *cerrando;   //zona anterior de una transicion encadenada, pendiente de cerrar
     char *desc;          //apuntador a config con la descripcion del grupo
+    uint16_t *idx;       //apuntador a config con el idx del grupo en Domoticz
   } ;
 
   union S_bFLAGS
@@ -344,7 +314,7 @@
   };
 
   struct S_BOTON {
-    uint16_t   id;
+    inmask_t   id;
     int   estado;
     int   ultimo_estado;
     int   led;
@@ -358,40 +328,92 @@
     uint8_t fase; 
   } ;
 
-  const uint16_t ZONAS[] = {_ZONAS};
-  const uint16_t GRUPOS[]  = {_GRUPOS};
-  const int NUMZONAS = sizeof(ZONAS)/sizeof(ZONAS[0]); // (7) numero de zonas (botones riego individual)
-  const int NUMGRUPOS = sizeof(GRUPOS)/sizeof(GRUPOS[0]); // (3) numero de grupos multirriego
+  //resultado de la verificacion asincrona del estado de una zona
+  struct S_VERIFY {
+    uint16_t idx;         //idx de la zona verificada
+    char status[4];       //estado esperado ("On" / "Off")
+    bool pending;         //peticion en curso
+    bool done;            //resultado disponible y no consumido
+    bool ok;              //el estado coincide con el esperado
+    uint8_t fase;         //fase de error si no coincide (CERO, E1, E2, E3)
+    bool delta;           //la peticion en curso solo pide cambios (lastupdate)
+    uint16_t lastIdx;     //idx del ultimo estado leido
+    char lastStatus[8];   //ultimo estado leido de lastIdx
+    uint32_t actTime;     //ActTime del servidor en la ultima lectura (0: pedir registro completo)
+    uint32_t sinCambios;  //sondeos resueltos sin cambios (respuesta vacia)
+  } ;
+
+  //estado de una zona en Domoticz
+  enum _estadosZona {
+    ZONA_DESCONOCIDO  ,
+    ZONA_OFF          ,
+    ZONA_ON           ,
+  };
+
+  //origen del ultimo estado reportado de una zona
+  enum _origenesShadow {
+    SH_NINGUNO  ,
+    SH_LISTA    ,   // lista de dispositivos (getFactors)
+    SH_STATUS   ,   // consulta de estado (queryStatus)
+    SH_SWITCH   ,   // confirmacion de una orden (domoticzSwitch)
+    SH_PUSH     ,   // aviso de Domoticz (domoticz/out por MQTT)
+  };
+
+  //sombra local del estado de una zona en Domoticz
+  struct S_SHADOW {
+    uint8_t deseado;            //ultimo estado ordenado por el controlador (_estadosZona)
+    uint8_t reportado;          //ultimo estado confirmado por Domoticz (_estadosZona)
+    unsigned long tDeseado;     //millis() de la ultima orden
+    unsigned long tReportado;   //millis() del ultimo estado confirmado
+    uint8_t origen;             //de donde viene el estado reportado (_origenesShadow)
+    uint8_t fallo;              //fase de error de una orden fallida aun sin tratar (CERO si no hay)
+    uint8_t falloOrden;         //estado que pedia esa orden (_estadosZona)
+  } ;
+
+  //peticiones a Domoticz evitadas gracias a la sombra local
+  struct S_SHADOWSTATS {
+    uint32_t switches;          //ordenes redundantes no enviadas
+    uint32_t status;            //verificaciones respondidas desde la sombra
+    uint32_t remotos;           //cambios remotos avisados por Domoticz (MQTT)
+    uint32_t msAdelanto;        //ms acumulados de adelanto del aviso frente al sondeo
+  } ;
+
+  //patron de animacion de LEDs (tiempos en frames de LEDS_ANIMHZ)
+  struct S_ANIM {
+    ledmask_t mask;             //LEDs del patron (0 = entrada libre)
+    uint16_t on;                //frames encendido de cada periodo
+    uint16_t off;               //frames apagado de cada periodo
+    uint8_t  repeat;            //periodos antes de terminar (0 = sin fin)
+    uint8_t  prio;              //prioridad (_anims)
+    uint32_t inicio;            //frame de arranque
+  } ;
+
+  //foto de las entradas de un loop(), compartida por todos los que consultan botones
+  struct S_INPUTS {
+    inmask_t estado;            //estado filtrado de las entradas (los flancos llegan por inputQueue)
+  } ;
+
+  //evento del lector de botones: entradas que han cambiado en una lectura
+  struct S_INPUTEV {
+    uint32_t ms;                //millis() de la lectura
+    inmask_t cambios;           //entradas con flanco (bits de Boton[].id)
+    inmask_t estado;            //estado filtrado de todas las entradas
+  } ;
+
   const char nEstado[][15] = {_ESTADOS};
 
    //Globales a todos los módulos
   #ifdef __MAIN__
 
-    S_BOTON Boton [] =  { 
-      //ID,          S   uS  LED          FLAGS                             DESC          IDX
-      {bZONA1   ,   0,  0,  lZONA1   ,   ENABLED | ACTION,                 "ZONA1",       0},
-      {bZONA2 ,     0,  0,  lZONA2 ,     ENABLED | ACTION,                 "ZONA2",       0},
-      {bZONA3    ,  0,  0,  lZONA3    ,  ENABLED | ACTION,                 "ZONA3",       0},
-      {bZONA4    ,  0,  0,  lZONA4    ,  ENABLED | ACTION,                 "ZONA4",       0},
-      {bZONA5    ,  0,  0,  lZONA5    ,  ENABLED | ACTION,                 "ZONA5",       0},
-      {bZONA6 ,     0,  0,  lZONA6 ,     ENABLED | ACTION,                 "ZONA6",       0},
-      {bZONA7  ,    0,  0,  lZONA7  ,    ENABLED | ACTION,                 "ZONA7",       0},
-      {bSPARE13,    0,  0,  0,           DISABLED,                         "spare13",     0},
-      {bSPARE15,    0,  0,  0,           DISABLED,                         "spare15",     0},
-      {bSPARE16,    0,  0,  0,           DISABLED,                         "spare16",     0},
-      {bENCODER,    0,  0,  0,           ENABLED | ONLYSTATUS | DUAL,      "ENCODER",     0},
-      {bMULTIRIEGO, 0,  0,  0,           ENABLED | ACTION,                 "MULTIRIEGO",  0},
-      {bGRUPO1,     0,  0,  lGRUPO1,     ENABLED | ONLYSTATUS | DUAL,      "GRUPO1",      0},
-      {bGRUPO2  ,   0,  0,  lGRUPO2  ,   DISABLED,                         "GRUPO2",      0},
-      {bGRUPO3,     0,  0,  lGRUPO3,     ENABLED | ONLYSTATUS | DUAL,      "GRUPO3",      0},
-      {bPAUSE,      0,  0,  0,           ENABLED | ACTION | DUAL | HOLD,   "PAUSE",       0},
-      {bSTOP,       0,  0,  0,           ENABLED | ACTION | DUAL,          "STOP",        0},
-      {bCONFIG,     0,  0,  0,           DISABLED,                         "CONFIG",      0}
-    };
+    //ID, S, uS, LED, FLAGS, DESC, IDX (del perfil _BOTONES de Hardware.h)
+    #define BOTON_ENTRY(id, led, flags, desc, zona, grupo)   {id, 0, 0, led, flags, desc, 0},
+    S_BOTON Boton [] =  { _BOTONES(BOTON_ENTRY) };
+    #undef BOTON_ENTRY
     int NUM_S_BOTON = sizeof(Boton)/sizeof(Boton[0]);
 
     S_MULTI multi;  
     S_initFlags initFlags ;
+    S_INPUTS entradas;
     bool connected;
     bool NONETWORK;
     bool falloAP;
@@ -399,11 +421,14 @@
     
     const char *parmFile = "/config_parm.json";       
     const char *defaultFile = "/config_default.json"; 
+    const char *factorsFile = "/factors.json";
+    Domoticz *domoticz;
 
   #else
     extern S_BOTON Boton [];
     extern S_MULTI multi;
     extern S_initFlags initFlags;
+    extern S_INPUTS entradas;
     extern bool connected;
     extern bool NONETWORK;
     extern bool falloAP;
@@ -411,6 +436,8 @@
     extern int NUM_S_BOTON;
     extern const char *parmFile;       
     extern const char *defaultFile; 
+    extern const char *factorsFile;
+    extern Domoticz *domoticz;
 
 
   #endif
@@ -419,8 +446,6 @@
     //Globales a este módulo
     #ifdef NODEMCU
       //Segun la arquitectura
-      WiFiClient client;
-      HTTPClient httpclient;
       WiFiUDP    ntpUDP;
     #endif
     CountUpDownTimer T(DOWN);
@@ -432,10 +457,19 @@
     ClickEncoder *Encoder;
     Display      *display;
     Configure    *configure;
+    DomoMqtt     *domoMqtt = NULL;
+    S_VERIFY     verify;
+    uint32_t     zonasLeidas;   // mascara de zonas encontradas por getFactors
+    unsigned long factorsRefresh;        // millis() de la ultima lectura de factores
+    bool         factorsPending;         // refresco de factores en curso
+    bool         factorsCambiados;       // algun factor o nombre ha cambiado en el ultimo refresco
+    S_SHADOW     shadow[NUMZONAS];       // sombra local del estado de cada zona
+    S_SHADOWSTATS shadowStats;
+    uint32_t     stopPendientes;         // mascara de zonas con Off de STOP sin confirmar
+    unsigned long stopInicio;            // millis() del ultimo stopAllRiego
+    uint32_t     grupoPendientes;        // mascara de zonas apagadas con el grupo de Domoticz sin confirmar
+    unsigned long tFlagV;                // millis() de la ultima ronda de verificaciones
     NTPClient timeClient(ntpUDP,config.ntpServer);
-    Ticker tic_parpadeoLedON;    //para parpadeo led ON (LEDR)
-    Ticker tic_parpadeoLedZona;  //para parpadeo led zona de riego
-    Ticker tic_parpadeoLedConf;  //para parpadeo led(s) indicadores de modo configuracion
     Ticker tic_verificaciones;   //para verificaciones periodicas
     TimeChangeRule CEST = {"CEST", Last, Sun, Mar, 2, 120};
     TimeChangeRule CET = {"CET ", Last, Sun, Oct, 3, 60};
@@ -449,7 +483,6 @@
     char  descDomoticz[20];
     int value;
     int savedValue;
-    int ledID = 0;
     bool tiempoTerminado;
     bool reposo = false;
     unsigned long standbyTime;
@@ -480,6 +513,18 @@
    */
   void apagaLeds(void);
 
+  /**
+   * @brief Measures the cycles per call of bID_bIndex() and bID_zIndex() against the former
+   * linear scans (DEBUG).
+   */
+  void benchLookups(void);
+
+  /**
+   * @brief Measures the cycles per call of led() and readInputs() against the former
+   * digitalWrite/shiftOut path (DEBUG).
+   */
+  void benchShiftRegisters(void);
+
   /**
    * @brief Emits a beep sound.
    * @param duration Duration of the beep.
@@ -499,34 +544,42 @@
   void bipEND(int duration);
 
   /**
-   * @brief Gets the index of a button by its ID.
-   * @param id Button ID.
-   * @return Index of the button.
+   * @brief Handles the blinking of the pause LED.
    */
-  int bID_bIndex(uint16_t id);
+  void blinkPause(void);
 
   /**
-   * @brief Gets the index of a zone by its ID.
-   * @param id Zone ID.
-   * @return Index of the zone.
+   * @brief Handles the blinking of the pause LED during an error.
    */
-  int bID_zIndex(uint16_t id);
+  void blinkPauseError(void);
 
   /**
-   * @brief Handles the blinking of the pause LED.
+   * @brief Switches the buzzer and writes the LED chain at once.
+   * @param state ON or OFF.
    */
-  void blinkPause(void);
+  void buzzer(int state);
 
   /**
-   * @brief Handles the blinking of the pause LED during an error.
+   * @brief Closes the next zone of a multirriego opened in advance (solape).
    */
-  void blinkPauseError(void);
+  void cancelaSolape(void);
+
+  /**
+   * @brief Closes the previous zone of a chained multirriego transition, if still open.
+   */
+  void cierraAnterior(void);
 
   /**
    * @brief Performs system checks.
    */
   void check(void);
 
+  /**
+   * @brief Checks that every button of the chain delivers its event through parseInputs(),
+   * alone and all at once (DEBUG).
+   */
+  void checkInputEvents(void);
+
   /**
    * @brief Checks the WiFi connection status.
    * @return True if WiFi is connected, false otherwise.
@@ -556,32 +609,76 @@
    * @param group Pointer to the group ID.
    * @param size Size of the group.
    */
-  void displayGrupo(uint16_t *group, int size);
+  void displayGrupo(inmask_t *group, int size);
+
+  /**
+   * @brief Sends a switchscene command to a Domoticz group.
+   * @param idx Domoticz idx of the group.
+   * @param msg "On" or "Off".
+   * @return True if the command was queued, false otherwise.
+   */
+  bool domoticzScene(uint16_t idx, const char *msg);
+
+  /**
+   * @brief Completion of a group command: on success the group status is queried.
+   * @param req Finished request.
+   * @param rc Result (_domoResultados).
+   * @param jsondoc Filtered response.
+   */
+  void domoticzSceneCallback(S_DOMOREQ *req, int rc, JsonDocument &jsondoc);
 
   /**
    * @brief Sends a switch command to Domoticz.
    * @param idx Index of the switch.
    * @param desc Description of the switch.
    * @param status Status to set.
-   * @return True if the command was successful, false otherwise.
+   * @return True if the command was queued (or not needed), false otherwise.
    */
   bool domoticzSwitch(int idx, char *desc, int status);
 
+  /**
+   * @brief Completion callback of domoticzSwitch: beeps on every retry and records the failure in the
+   * shadow when all fail (raised later by procesaFallosSwitch).
+   * @param req Finished request.
+   * @param rc Result of the request (_domoResultados).
+   * @param jsondoc Filtered response from Domoticz.
+   */
+  void domoticzSwitchCallback(S_DOMOREQ *req, int rc, JsonDocument &jsondoc);
+
   /**
    * @brief Turns on all LEDs.
    */
   void enciendeLeds(void);
 
+  /**
+   * @brief Converts a Domoticz Status to the known state of a zone.
+   * @param status Status field ("On" / "Off").
+   * @return ZONA_ON, ZONA_OFF or ZONA_DESCONOCIDO.
+   */
+  uint8_t estadoStatus(const char *status);
+
   /**
    * @brief Ends the web server.
    */
   void endWS(void);
 
+  /**
+   * @brief Converts the Description of a Domoticz device to an irrigation factor.
+   * @param factorstr Description field.
+   * @return Factor (100 if the description is not a number).
+   */
+  int factorDesc(const char *factorstr);
+
   /**
    * @brief Displays file information.
    */
   void filesInfo(void);
 
+  /**
+   * @brief Publishes the LED frame built with led() for the chain writer (ledsISR).
+   */
+  void flushLeds(void);
+
   /**
    * @brief Sets the verification flag.
    */
@@ -595,17 +692,31 @@
   int getFactor(uint16_t id);
 
   /**
-   * @brief Gets the status of multiple items.
-   * @return Status of the items.
+   * @brief Reads the factors and names of all zones with a single request.
+   * @return True if the factors were read, false to fall back to getFactor.
    */
-  uint16_t getMultiStatus(void);
+  bool getFactors(void);
 
   /**
-   * @brief Sends an HTTP GET request to Domoticz.
-   * @param url URL to send the request to.
-   * @return Response from Domoticz.
+   * @brief Checks that every zone with idx came in the device list (zonasLeidas).
+   * A missing zone is E3 when VERIFY is on; otherwise it waters with factor 100.
+   * @return False if a missing zone raised E3.
    */
-  String *httpGetDomoticz(String *url);
+  bool checkZonasLeidas(void);
+
+  /**
+   * @brief Device list callback of getFactors: sets the factor of the zone with that idx.
+   * @param req Request in progress.
+   * @param rc Result (DOMO_ITEM).
+   * @param device Filtered device of the list.
+   */
+  void getFactorsItem(S_DOMOREQ *req, int rc, JsonDocument &device);
+
+  /**
+   * @brief Gets the position of the group selector from the input snapshot.
+   * @return Button ID of the selected group.
+   */
+  inmask_t getMultiStatus(void);
 
   /**
    * @brief Displays information on the display.
@@ -616,6 +727,11 @@
    */
   void infoDisplay(const char *text, int x, int y, int size);
 
+  /**
+   * @brief Opens the next zone of a multirriego before the current one ends (solape).
+   */
+  void iniciaSolape(void);
+
   /**
    * @brief Initializes the CD4021B chip.
    */
@@ -641,6 +757,11 @@
    */
   void initLastRiegos(void);
 
+  /**
+   * @brief Starts the timer1 interrupt that writes the LED chain and scans the buttons (ledsISR).
+   */
+  void initLedsPWM(void);
+
   /**
    * @brief Initializes the LEDs.
    */
@@ -651,10 +772,10 @@
    * @param id ID to initialize the irrigation for.
    * @return True if the initialization was successful, false otherwise.
    */
-  bool initRiego(uint16_t id);
+  bool initRiego(inmask_t id);
 
   /**
-   * @brief Controls the state of a LED.
+   * @brief Sets the state of a LED in the frame (written by flushLeds()).
    * @param led LED ID.
    * @param state State to set.
    */
@@ -681,6 +802,51 @@
    */
   bool ledStatusId(int id);
 
+  /**
+   * @brief Starts an animation pattern: the LEDs of the mask are on for onMs and off for offMs.
+   * It replaces any pattern of the same priority on those LEDs.
+   * @param mask LEDs of the pattern (LEDBIT).
+   * @param onMs Time on of each period.
+   * @param offMs Time off of each period.
+   * @param repeat Number of periods, 0 for endless.
+   * @param prio Priority (_anims).
+   * @param desfaseMs Offset into the period of the first frame.
+   * @return False if the pattern table is full.
+   */
+  bool ledAnim(ledmask_t mask, uint16_t onMs, uint16_t offMs, uint8_t repeat, uint8_t prio, uint16_t desfaseMs = 0);
+
+  /**
+   * @brief Ends the animation patterns of a priority: their LEDs go back to their steady state.
+   * @param prio Priority (_anims).
+   */
+  void ledAnimStop(uint8_t prio);
+
+  /**
+   * @brief Sets the state of a set of LEDs in the frame at once.
+   * @param mask LEDs (LEDBIT, LEDS_ZONAS, LEDS_GRUPOS).
+   * @param estado ON or OFF.
+   */
+  void ledMask(ledmask_t mask, int estado);
+
+  /**
+   * @brief Sets the brightness of a LED.
+   * @param id LED ID.
+   * @param duty Level, from 0 (off) to LEDS_PWMSTEPS (full).
+   */
+  void ledPWM(uint8_t id, uint8_t duty);
+
+  /**
+   * @brief timer1 interrupt: the only writer of the LED chain (animations and PWM) and
+   * scanner of the buttons (debounce and event queue).
+   */
+  void ledsISR(void);
+
+  /**
+   * @brief Shows the led() calls and the physical writes of the LED chain per second
+   * since the previous call.
+   */
+  void ledStatsInfo(void);
+
   /**
    * @brief Reads data from the serial port.
    */
@@ -694,6 +860,13 @@
    */
   bool loadConfigFile(const char* filename, Config_parm& config);
 
+  /**
+   * @brief Loads the factors and names of the zones cached by saveFactorsFile.
+   * @param filename Path to the cache file.
+   * @return True if the cache matches the configured idx of every zone.
+   */
+  bool loadFactorsFile(const char* filename);
+
   /**
    * @brief Loads the default signal.
    * @param signal Signal to load.
@@ -712,21 +885,18 @@
   void memoryInfo(void);
 
   /**
-   * @brief Handles the blinking of the ON LED.
-   */
-  void parpadeoLedON(void);
-
-  /**
-   * @brief Handles the blinking of the zone LED.
+   * @brief Delivers the next button edge queued by the scanner in ledsISR, or the repeat
+   * of a hold button still pressed.
+   * @param state READ to get the button, CLEAR to discard the queued edges.
+   * @return Pointer to the button, NULL if there is none.
    */
-  void parpadeoLedZona(void);
+  S_BOTON *parseInputs(bool state);
 
   /**
-   * @brief Parses the inputs.
-   * @param state State to parse.
-   * @return Pointer to the parsed button.
+   * @brief Finds the next zone of the multirriego that has to be watered, so the
+   * transition can be done without going through STANDBY.
    */
-  S_BOTON *parseInputs(bool state);
+  void preparaSiguiente(void);
 
   /**
    * @brief Prints a character array.
@@ -785,6 +955,28 @@
    */
   void procesaBotonZona(void);
 
+  /**
+   * @brief Handles a switch state pushed by Domoticz over MQTT.
+   * @param idx Domoticz idx of the device.
+   * @param on New state of the device.
+   */
+  void procesaCambioRemoto(uint16_t idx, bool on);
+
+  /**
+   * @brief Sends by HTTP a switch command published over MQTT whose echo never came back.
+   * @param idx Domoticz idx of the device.
+   * @param on State ordered.
+   */
+  void procesaSinEco(uint16_t idx, bool on);
+
+  /**
+   * @brief Handles a change notified on /notify. The request is not authenticated, so the
+   * state it claims is not trusted: it only brings forward the verification of the zone in
+   * course, asking Domoticz.
+   * @param idx Domoticz idx of the device.
+   */
+  void procesaAviso(uint16_t idx);
+
   /**
    * @brief Processes the encoder.
    */
@@ -795,6 +987,12 @@
    */
   void procesaEstados(void);
 
+  /**
+   * @brief Raises the errors of the switch orders that failed for good, as recorded in the
+   * shadow by domoticzSwitchCallback().
+   */
+  void procesaFallosSwitch(void);
+
   /**
    * @brief Processes the configuring state.
    */
@@ -830,18 +1028,56 @@
    */
   void procesaEstadoPause(void);
 
+  /**
+   * @brief Serves the notification endpoint (/notify).
+   */
+  void procesaNotify(void);
+
   /**
    * @brief Processes the web server.
    */
   void procesaWebServer(void);
 
   /**
-   * @brief Queries the status of a given ID.
-   * @param id ID to query.
-   * @param status Status to query.
-   * @return True if the query was successful, false otherwise.
+   * @brief Queues a query of the status of a Domoticz group (one response for all its zones).
+   * @param idx Domoticz idx of the group.
+   */
+  void queryGrupo(uint16_t idx);
+
+  /**
+   * @brief Receives the scenes/groups list of queryGrupo.
+   * @param req Request in progress.
+   * @param rc DOMO_ITEM for every element, then the final result.
+   * @param scene Filtered element of the list.
+   */
+  void queryGrupoItem(S_DOMOREQ *req, int rc, JsonDocument &scene);
+
+  /**
+   * @brief Queues an asynchronous query of the status of a given idx.
+   * @param idx Domoticz idx to query.
+   * @param status Expected status ("On" / "Off").
+   * @param consulta true to ask Domoticz even if the shadow is fresh.
+   */
+  void queryStatus(uint16_t idx, const char *status, bool consulta = false);
+
+  /**
+   * @brief Completion callback of queryStatus.
+   * @param req Finished request.
+   * @param rc Result of the request (_domoResultados).
+   * @param jsondoc Filtered response from Domoticz.
+   */
+  void queryStatusCallback(S_DOMOREQ *req, int rc, JsonDocument &jsondoc);
+
+  /**
+   * @brief Compares the status read with the expected one and leaves the verdict in verify.
+   * @param actual_status Status of the zone in Domoticz.
    */
-  bool queryStatus(uint16_t id, char *status);
+  void queryStatusResult(const char *actual_status);
+
+  /**
+   * @brief Starts a background read of the factors in STANDBY when they are older than half FACTORS_TTL.
+   */
+  void refreshFactors(void);
 
   /**
    * @brief Refreshes the time.
@@ -871,19 +1107,75 @@
    */
   bool saveConfigFile(const char* filename, Config_parm& config);
 
+  /**
+   * @brief Caches the factors and names of the zones with a timestamp.
+   * @param filename Path to the cache file.
+   * @return True if the file was saved successfully, false otherwise.
+   */
+  bool saveFactorsFile(const char* filename);
+
   /**
    * @brief Sets the system state.
    * @param state State to set.
    */
   void setEstado(uint8_t state);
 
+  /**
+   * @brief Stores in the shadow the state ordered to the zones with a given idx.
+   * @param idx Domoticz idx.
+   * @param estado ZONA_ON, ZONA_OFF or ZONA_DESCONOCIDO.
+   */
+  void setShadowDeseado(uint16_t idx, uint8_t estado);
+
+  /**
+   * @brief Records in the shadow a switch order that failed for good, to be raised by procesaFallosSwitch().
+   * @param idx Domoticz idx.
+   * @param orden ZONA_ON or ZONA_OFF.
+   * @param fase Error phase (E2, E4, E5).
+   */
+  void setShadowFallo(uint16_t idx, uint8_t orden, uint8_t fase);
+
+  /**
+   * @brief Stores in the shadow the state reported for the zones with a given idx.
+   * @param idx Domoticz idx.
+   * @param estado ZONA_ON, ZONA_OFF or ZONA_DESCONOCIDO.
+   * @param origen Where the state comes from (_origenesShadow).
+   */
+  void setShadowReportado(uint16_t idx, uint8_t estado, uint8_t origen);
+
+  /**
+   * @brief Checks if the shadow of a zone can be trusted without asking Domoticz.
+   * @param zIndex Index of the zone.
+   * @return true if the reported state is known, matches the last order and is younger than shadowMaxAge.
+   */
+  bool shadowFresco(int zIndex);
+
+  /**
+   * @brief Prints the shadow of every zone and the requests it saved.
+   */
+  void shadowInfo(void);
+
+  /**
+   * @brief Finds the zone with a given idx.
+   * @param idx Domoticz idx.
+   * @return Index of the zone, 999 if not found.
+   */
+  int shadowZona(uint16_t idx);
+
+  /**
+   * @brief Stores the factor of a zone and the name read from Domoticz.
+   * @param zIndex Index of the zone.
+   * @param factor Irrigation factor.
+   */
+  void setFactorZona(int zIndex, uint factor);
+
   /**
    * @brief Sets the multi-irrigation by ID.
    * @param id ID to set.
    * @param config Configuration structure.
    * @return Index of the multi-irrigation.
    */
-  int setMultibyId(uint16_t id, Config_parm& config);
+  int setMultibyId(inmask_t id, Config_parm& config);
 
   /**
    * @brief Sets up the configuration.
@@ -903,6 +1195,11 @@
    */
   void setupInit(void);
 
+  /**
+   * @brief Starts the always listening notification endpoint.
+   */
+  void setupNotify(void);
+
   /**
    * @brief Sets up the parameters.
    */
@@ -937,26 +1234,55 @@
    */
   void statusError(uint8_t error, int n);
 
+  /**
+   * @brief Consumes the result of the last status verification.
+   * @param idx Domoticz idx verified.
+   * @param status Expected status ("On" / "Off").
+   * @param ok Set to true if the status matched the expected one.
+   * @return True if a new result for idx/status was available.
+   */
+  bool statusVerified(uint16_t idx, const char *status, bool *ok);
+
   /**
    * @brief Stops the irrigation for a given ID.
    * @param id ID to stop the irrigation for.
    * @return True if the irrigation was stopped successfully, false otherwise.
    */
-  bool stopRiego(uint16_t id);
+  bool stopRiego(inmask_t id);
 
   /**
    * @brief Stops all irrigation.
-   * @return True if all irrigation was stopped successfully, false otherwise.
+   * Every zone gets its Off even if an earlier one could not be sent; while the
+   * Domoticz queue is full the engine is served until the Off fits.
+   * @return True if the Off of every zone was sent, false otherwise.
    */
   bool stopAllRiego(void);
 
   /**
-   * @brief Tests a button.
+   * @brief Marks as acknowledged the Off sent by stopAllRiego to the zones with a given idx.
+   * @param idx Domoticz idx.
+   */
+  void stopConfirmado(uint16_t idx);
+
+  /**
+   * @brief Sends Off zone by zone to the zones of a mask still pending of stopAllRiego.
+   * @param mask Zones (bit = zIndex).
+   */
+  void stopZonas(uint32_t mask);
+
+  /**
+   * @brief Tests a button in the input snapshot of this loop (tomaEntradas).
    * @param id Button ID.
    * @param state State to test.
    * @return True if the button test was successful, false otherwise.
    */
-  bool testButton(uint16_t id, bool state);
+  bool testButton(inmask_t id, bool state);
+
+  /**
+   * @brief Takes the input snapshot of this loop from the state debounced by ledsISR,
+   * with the inputs pressed and released since the previous one.
+   */
+  void tomaEntradas(void);
 
   /**
    * @brief Calculates the time by factor.
@@ -0,0 +1,124 @@
+/**
+ * @file DomoMqtt.h
+ * @brief MQTT transport for Domoticz.
+ *
+ * The DomoMqtt class keeps a connection with the MQTT broker used by Domoticz,
+ * subscribes to domoticz/out to be told at once of every change of state of
+ * the zones and publishes switch commands to domoticz/in. It is optional
+ * (config "domoticz" -> "mqtt") and the HTTP engine remains as fallback while
+ * the broker is not reachable. An unreachable or silent broker costs loop()
+ * at most MQTT_CONNECTTIMEOUT ms plus MQTT_SOCKETTIMEOUT s every
+ * MQTT_RECONNECT ms.
+ *
+ * Publishing a command does not tell whether Domoticz executed it, so every
+ * published command is kept until its echo (the new state of the device) comes
+ * back on domoticz/out. A command without echo after MQTT_ACKTIMEOUT ms, or
+ * pending when the connection drops, is handed back through the lost callback
+ * so that the caller can send it another way.
+ *
+ * @note This file is part of the ControlRiego-2.5 project.
+ */
+
+#ifndef DomoMqtt_h
+#define DomoMqtt_h
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <PubSubClient.h>
+#ifdef NODEMCU
+  #include <ESP8266WiFi.h>
+#endif
+
+#define MQTT_TOPIC_IN         "domoticz/in"
+#define MQTT_TOPIC_OUT        "domoticz/out"
+#define MQTT_BUFFERSIZE       768   // bytes de un mensaje de domoticz/out
+#define MQTT_CONNECTTIMEOUT   1000  // ms maximos para conectar con el broker
+#define MQTT_SOCKETTIMEOUT    1     // s maximos esperando una respuesta del broker (CONNACK o resto de un mensaje)
+#define MQTT_RECONNECT        10000 // ms entre intentos de conexion con el broker
+#define MQTT_ACKTIMEOUT       5000  // ms maximos hasta el eco de una orden en domoticz/out (como DOMO_TIMEOUT)
+#define MQTT_PENDING          8     // ordenes publicadas esperando su eco
+
+/**
+ * @brief Called for every switch state received from domoticz/out.
+ * @param idx Domoticz idx of the device.
+ * @param on New state of the device.
+ */
+typedef void (*mqttCallback)(uint16_t idx, bool on);
+
+//orden publicada en domoticz/in sin eco todavia
+struct S_MQTTCMD {
+  uint16_t idx;               // 0: libre
+  bool on;                    // estado ordenado
+  unsigned long sent;         // millis() de la publicacion
+};
+
+/**
+ * @class DomoMqtt
+ * @brief Push based link with Domoticz over MQTT.
+ */
+class DomoMqtt
+{
+  private:
+    WiFiClient _client; ///< Socket to the broker.
+    PubSubClient _mqtt; ///< MQTT client.
+    const char *_host; ///< Broker IP (points to config).
+    uint16_t _port; ///< Broker port.
+    mqttCallback _callback; ///< Receiver of the switch states.
+    mqttCallback _lostCallback; ///< Receiver of the commands without echo.
+    S_MQTTCMD _pending[MQTT_PENDING]; ///< Published commands waiting for their echo.
+    unsigned long _lastAttempt; ///< millis() of the last connection attempt.
+    bool _up; ///< Connected and subscribed.
+    uint32_t _received; ///< Messages received from domoticz/out.
+    uint32_t _published; ///< Commands published to domoticz/in.
+    uint32_t _lost; ///< Commands handed back without echo.
+    static DomoMqtt *_instance; ///< Instance receiving the PubSubClient callback.
+
+    static void onMessage(char *topic, uint8_t *payload, unsigned int length);
+    void reconnect(void);
+    void expire(bool all);
+
+  public:
+    /**
+     * @brief Construct a new MQTT transport.
+     * @param host Broker IP address.
+     * @param port Broker port.
+     * @param callback Function called for every switch state received.
+     * @param lostCallback Function called for every command without echo.
+     */
+    DomoMqtt(const char *host, const char *port, mqttCallback callback, mqttCallback lostCallback);
+
+    /**
+     * @brief Keeps the connection, dispatches the received messages and expires the commands without echo. Call from loop().
+     */
+    void service(void);
+
+    /**
+     * @brief Checks if the subscription to domoticz/out is active.
+     */
+    bool connected(void);
+
+    /**
+     * @brief Publishes a switchlight command to domoticz/in and waits for its echo.
+     * @param idx Domoticz idx of the switch.
+     * @param cmd "On" or "Off".
+     * @return false if the broker is not connected or MQTT_PENDING commands wait for their echo.
+     */
+    bool switchLight(uint16_t idx, const char *cmd);
+
+    /**
+     * @brief Number of messages received from domoticz/out.
+     */
+    uint32_t received(void);
+
+    /**
+     * @brief Number of commands published to domoticz/in.
+     */
+    uint32_t published(void);
+
+    /**
+     * @brief Number of commands handed back without echo.
+     */
+    uint32_t lost(void);
+};
+
+#endif // DomoMqtt_h
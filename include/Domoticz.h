@@ -0,0 +1,353 @@
+/**
+ * @file Domoticz.h
+ * @brief Asynchronous request engine for the Domoticz JSON API.
+ *
+ * The Domoticz class keeps a bounded queue of HTTP GET requests to the Domoticz
+ * server and advances them a slice at a time from loop(), so the control loop
+ * never stalls waiting for the network. Up to DOMO_SLOTS requests run at the
+ * same time, each over its own connection; requests of the same idx are never
+ * sent concurrently, so their order is kept. Connections are kept alive
+ * between requests and reopened transparently when the server closes them.
+ *
+ * Every service() call reads at most DOMO_SLICEBYTES bytes per slot and never
+ * waits for data that has not arrived. The only blocking call left is the
+ * connect() of a fresh connection (up to DOMO_CONNECTTIMEOUT ms). At most one
+ * is attempted per service() call, and after a failed one no other is tried
+ * until a backoff has passed (the one of the retries), so an unreachable
+ * Domoticz costs loop() at most one DOMO_CONNECTTIMEOUT stall per backoff
+ * period, not one per slot.
+ *
+ * Responses are never copied whole to RAM: the body is scanned as it arrives
+ * and only status, ActTime and the idx, Name, Description and Status of the
+ * results are kept (each value cut to DOMO_VALUESIZE characters) in a small
+ * buffer of the slot. Once the body is complete that buffer is deserialized
+ * into a small document owned by the engine. The elements of a device list are
+ * deserialized one at a time as soon as each one is complete, so the size of
+ * the list is not limited by RAM. A list without result (Domoticz leaves it out
+ * when nothing matches) or with an empty one ends DOMO_OK with no elements.
+ *
+ * Requests answered with status ERR can be retried by the engine itself with
+ * exponential backoff and jitter: the request waits in the queue until its
+ * time comes, without blocking loop() nor the requests queued behind it. A
+ * new switch command for the same idx supersedes a pending one.
+ *
+ * The server address and the fixed part of the request headers are compiled
+ * once by setServer() (on construction and whenever the configuration
+ * changes); every request is then formatted into fixed buffers from the
+ * PROGMEM templates DOMO_URL_*, with no String temporaries on the heap. Response
+ * headers are read into a fixed line buffer of each slot.
+ *
+ * For every request type the engine keeps in RAM the count of each result
+ * and of the retries, and a fixed-bucket latency histogram of each phase of
+ * the request (connect, first byte, body, parse), dumped by printStats().
+ *
+ * @note This file is part of the ControlRiego-2.5 project.
+ */
+
+#ifndef Domoticz_h
+#define Domoticz_h
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#ifdef NODEMCU
+  #include <ESP8266WiFi.h>
+#endif
+#include "Hardware.h"
+
+#define DOMO_SLOTS            3     // peticiones simultaneas (una conexion por slot)
+#define DOMO_QUEUE            (NUMZONAS + DOMO_SLOTS + 4)   // peticiones maximas en cola (un STOP encola un Off por zona)
+#define DOMO_PATHSIZE         96    // longitud maxima del path de una peticion
+#define DOMO_DOCSIZE          384   // memoria del documento JSON filtrado
+#define DOMO_BODYSIZE         256   // cuerpo filtrado de una respuesta (o de un elemento de una lista)
+#define DOMO_VALUESIZE        24    // caracteres que se conservan de cada valor del cuerpo
+#define DOMO_DEPTH            16    // anidamiento maximo del JSON de una respuesta
+#define DOMO_CONNECTTIMEOUT   1000  // ms maximos para establecer la conexion
+#define DOMO_TIMEOUT          5000  // ms maximos para completar una peticion
+#define DOMO_SLICEBYTES       256   // bytes maximos leidos en cada slice
+#define DOMO_RETRYBASE        500   // ms de espera antes del primer reintento
+#define DOMO_RETRYMAX         8000  // ms maximos de espera entre reintentos
+#define DOMO_HOSTSIZE         40    // longitud maxima de la IP de Domoticz
+#define DOMO_HEADERSIZE       96    // cabeceras fijas de una peticion (Host, Connection)
+#define DOMO_LINESIZE         128   // linea de cabecera de la respuesta (se trunca si es mas larga)
+#define DOMO_TIPOS            6     // tipos de peticion (_domoTipos)
+#define DOMO_BUCKETS          8     // intervalos de los histogramas de latencia
+
+//un STOP pone en cola el Off de todas las zonas mientras los slots pueden estar ocupados
+static_assert(DOMO_QUEUE >= NUMZONAS + DOMO_SLOTS, "la cola de Domoticz no admite un Off por zona");
+static_assert(DOMO_QUEUE < 256, "los indices de la cola son de 8 bits");
+
+//plantillas (en flash) del path de las peticiones, para snprintf_P
+static const char DOMO_URL_DEVICE[] PROGMEM = "/json.htm?type=devices&rid=%d";
+static const char DOMO_URL_DEVICEDELTA[] PROGMEM = "/json.htm?type=devices&rid=%d&lastupdate=%lu";
+static const char DOMO_URL_LIGHTS[] PROGMEM = "/json.htm?type=devices&filter=light&used=true";
+static const char DOMO_URL_SWITCH[] PROGMEM = "/json.htm?type=command&param=switchlight&idx=%d&switchcmd=%s";
+static const char DOMO_URL_SCENE[] PROGMEM = "/json.htm?type=command&param=switchscene&idx=%d&switchcmd=%s";
+static const char DOMO_URL_SCENES[] PROGMEM = "/json.htm?type=scenes";
+
+//Enumerados para los tipos de peticion
+enum _domoTipos {
+  DOMO_FACTOR   ,
+  DOMO_STATUS   ,
+  DOMO_SWITCH   ,
+  DOMO_FACTORS  ,   // lista de dispositivos: un callback DOMO_ITEM por elemento
+  DOMO_SCENE    ,   // orden a un grupo de Domoticz
+  DOMO_SCENES   ,   // lista de escenas/grupos: un callback DOMO_ITEM por elemento
+};
+
+//Enumerados para el resultado de una peticion
+enum _domoResultados {
+  DOMO_OK       ,   // respuesta correcta
+  DOMO_ERR2     ,   // error de comunicacion o HTTP
+  DOMO_ERRX     ,   // Domoticz devuelve status ERR
+  DOMO_ERRJSON  ,   // respuesta no interpretable
+  DOMO_ITEM     ,   // un elemento de una lista de dispositivos
+  DOMO_RETRY    ,   // fallo con reintento programado (no es el resultado final)
+};
+
+//Enumerados para las fases de una peticion (histogramas de latencia)
+enum _domoFases {
+  DOMO_T_CONNECT    ,   // hasta conexion establecida y peticion enviada
+  DOMO_T_FIRSTBYTE  ,   // hasta el primer byte de la respuesta
+  DOMO_T_BODY       ,   // hasta leer las cabeceras
+  DOMO_T_PARSE      ,   // lectura e interpretacion del cuerpo
+  DOMO_T_FASES      ,
+};
+
+//estadisticas de un tipo de peticion
+struct S_DOMOSTATS {
+  uint32_t ok;              // respuestas correctas
+  uint32_t comm;            // errores de comunicacion (conexion, timeout)
+  uint32_t http;            // respuestas HTTP distintas de 200
+  uint32_t errx;            // Domoticz devuelve status ERR
+  uint32_t json;            // respuestas no interpretables
+  uint32_t retries;         // reintentos programados
+  uint32_t superseded;      // fallos descartados por orden sustituida
+  uint16_t hist[DOMO_T_FASES][DOMO_BUCKETS];  // peticiones por intervalo de ms
+  uint32_t maxMs[DOMO_T_FASES];               // peor latencia de cada fase
+  uint32_t sumMs[DOMO_T_FASES];               // suma de latencias (para la media)
+};
+
+struct S_DOMOREQ;
+
+/**
+ * @brief Completion callback of an asynchronous request.
+ * @param req Request that has finished.
+ * @param rc Result (_domoResultados).
+ * @param doc Filtered response (valid only during the call).
+ */
+typedef void (*domoCallback)(S_DOMOREQ *req, int rc, JsonDocument &doc);
+
+//estructura de una peticion en cola
+struct S_DOMOREQ {
+  char path[DOMO_PATHSIZE];
+  uint8_t tipo;
+  uint16_t idx;
+  bool sync;
+  uint8_t retries;          // reintentos que quedan
+  uint8_t attempt;          // intentos fallidos hasta ahora
+  unsigned long notBefore;  // millis() a partir del cual puede enviarse
+  domoCallback callback;
+};
+
+//lectura incremental del cuerpo de una respuesta: solo se copian a out los campos que se conservan
+struct S_DOMOSCAN {
+  char out[DOMO_BODYSIZE];    // JSON filtrado (en las listas, el elemento en curso)
+  uint16_t outLen;            // caracteres en out
+  bool lleno;                 // algun campo no ha cabido en out
+  uint8_t depth;              // objetos y arrays abiertos
+  uint16_t objetos;           // bit n: el nivel n+1 es un objeto (si no, un array)
+  uint8_t modo;               // que se esta leyendo (_domoScan)
+  bool escape;                // el caracter anterior de la cadena abre un escape
+  bool esperaClave;           // la siguiente cadena del objeto es una clave
+  char key[12];               // ultima clave leida (se descartan las mas largas)
+  uint8_t keyLen;             // caracteres en key
+  int8_t campo;               // campo cuyo valor se esta copiando (-1 ninguno)
+  uint16_t valuePos;          // posicion en out del valor que se copia
+  uint8_t valueLen;           // caracteres copiados de ese valor
+  bool enResult;              // dentro del array result
+  bool enItem;                // dentro de un elemento de result que se copia
+  bool items;                 // ya se ha copiado un elemento (peticiones de un dispositivo)
+  bool statusErr;             // la respuesta trae status ERR
+};
+
+//una conexion con Domoticz y la peticion que lleva en curso
+struct S_DOMOSLOT {
+  WiFiClient client;
+  S_DOMOREQ req;
+  uint8_t state;
+  unsigned long start;        // millis() al iniciar la peticion
+  uint8_t fases;              // fases completadas por la peticion (bit 1 << DOMO_T_*)
+  unsigned long tSent;        // millis() con la peticion enviada
+  unsigned long tFirst;       // millis() del primer byte de la respuesta
+  unsigned long tBody;        // millis() con las cabeceras leidas
+  unsigned long tParsed;      // millis() con el cuerpo interpretado
+  int httpCode;               // 0 hasta leer la linea de estado
+  long contentLength;         // -1 si no se conoce
+  bool keepAlive;             // el servidor mantiene la conexion tras la respuesta
+  bool reused;                // la peticion reutiliza una conexion abierta
+  unsigned long received;     // bytes recibidos de la peticion
+  long bodyLeft;              // bytes del cuerpo aun no leidos (-1 si no se conoce)
+  char line[DOMO_LINESIZE];    // linea de cabecera en recepcion
+  uint8_t lineLen;            // caracteres en line
+  S_DOMOSCAN scan;            // lectura del cuerpo
+};
+
+/**
+ * @class Domoticz
+ * @brief Non-blocking HTTP client for the Domoticz server.
+ *
+ * Requests are queued with request() and completed by successive calls to
+ * service(). get() is a synchronous wrapper kept for the few places that
+ * need the answer before going on (boot).
+ */
+class Domoticz
+{
+  private:
+    char _host[DOMO_HOSTSIZE]; ///< Domoticz IP.
+    uint16_t _port; ///< Domoticz port.
+    IPAddress _ip; ///< Domoticz IP already parsed (not set if _host is a name).
+    char _headers[DOMO_HEADERSIZE]; ///< Fixed headers of every request.
+    S_DOMOSLOT _slots[DOMO_SLOTS]; ///< Connections and requests in progress.
+    S_DOMOREQ _queue[DOMO_QUEUE]; ///< Circular queue of requests not sent yet.
+    uint8_t _head; ///< Index of the first queued request.
+    uint8_t _count; ///< Number of requests in the queue.
+    uint32_t _connects; ///< Fresh connections opened.
+    uint32_t _reuses; ///< Requests sent over an already open connection.
+    bool _connectSlice; ///< A fresh connection was already attempted in this service() call.
+    uint8_t _connectFails; ///< Consecutive failed connections.
+    unsigned long _connectNotBefore; ///< millis() from which a fresh connection may be attempted.
+    S_DOMOSTATS _stats[DOMO_TIPOS]; ///< Counters and latencies by request type.
+    StaticJsonDocument<DOMO_DOCSIZE> _doc; ///< Filtered response.
+    bool _syncDone; ///< Synchronous request finished.
+    int _syncRc; ///< Result of the synchronous request.
+
+    void serviceSlot(S_DOMOSLOT *s);
+    void sendRequest(S_DOMOSLOT *s);
+    void readHeaders(S_DOMOSLOT *s);
+    int readBody(S_DOMOSLOT *s);
+    int scan(S_DOMOSLOT *s, char c);
+    int parseBody(S_DOMOSLOT *s);
+    bool reconnect(S_DOMOSLOT *s);
+    void finish(S_DOMOSLOT *s, int rc, const char *error);
+    bool schedule(S_DOMOSLOT *s);
+    bool busy(uint16_t idx);
+    void remove(uint8_t pos);
+    bool superseded(S_DOMOREQ *req);
+    void record(S_DOMOSLOT *s, int rc);
+    void recordPhase(S_DOMOSTATS *st, uint8_t fase, unsigned long from, unsigned long to);
+
+  public:
+    /**
+     * @brief Construct a new Domoticz engine.
+     * @param host Domoticz IP address.
+     * @param port Domoticz port.
+     */
+    Domoticz(const char *host, const char *port);
+
+    /**
+     * @brief Sets the Domoticz server and compiles the fixed part of the requests.
+     * @param host Domoticz IP address.
+     * @param port Domoticz port.
+     */
+    void setServer(const char *host, const char *port);
+
+    /**
+     * @brief Queues an asynchronous GET request.
+     * @param path Path and query of the request (json.htm...).
+     * @param tipo Request type (_domoTipos).
+     * @param idx Domoticz idx the request refers to.
+     * @param callback Function called when the request finishes.
+     * @param retries Retries with backoff if Domoticz answers status ERR.
+     * @return false if the queue is full.
+     */
+    bool request(const char *path, uint8_t tipo, uint16_t idx, domoCallback callback, uint8_t retries = 0);
+
+    /**
+     * @brief Sends a GET request and waits for its response.
+     * @param path Path and query of the request (json.htm...).
+     * @param tipo Request type (_domoTipos).
+     * @param idx Domoticz idx the request refers to.
+     * @param itemCallback Called for every element of a list (DOMO_FACTORS, DOMO_SCENES).
+     * @return Result (_domoResultados); the response is left in doc().
+     */
+    int get(const char *path, uint8_t tipo, uint16_t idx, domoCallback itemCallback = NULL);
+
+    /**
+     * @brief Filtered response of the last synchronous request.
+     */
+    JsonDocument &doc(void);
+
+    /**
+     * @brief Advances every request in progress one slice. Call from loop().
+     */
+    void service(void);
+
+    /**
+     * @brief Number of requests waiting or in progress.
+     */
+    int pending(void);
+
+    /**
+     * @brief Checks if there is a retry waiting for an idx.
+     * @param idx Domoticz idx.
+     * @return true if a failed request of that idx is waiting to be retried.
+     */
+    bool retrying(uint16_t idx);
+
+    /**
+     * @brief Checks if there is a request of an idx waiting or in progress.
+     * @param idx Domoticz idx.
+     * @return true until the callback of its last request has been called.
+     */
+    bool inFlight(uint16_t idx);
+
+    /**
+     * @brief Drops the switch commands of an idx not sent yet.
+     * @param idx Domoticz idx.
+     * @return Number of requests dropped.
+     */
+    int cancel(uint16_t idx);
+
+    /**
+     * @brief Services the queue until it is empty or the timeout expires.
+     * @param timeout Maximum ms to wait.
+     * @return true if all the requests finished.
+     */
+    bool flush(unsigned long timeout);
+
+    /**
+     * @brief Services the queue until it has room for one more request or the timeout expires.
+     * @param timeout Maximum ms to wait.
+     * @return true if the next request() will be queued.
+     */
+    bool room(unsigned long timeout);
+
+    /**
+     * @brief Number of fresh connections opened to Domoticz.
+     */
+    uint32_t connects(void);
+
+    /**
+     * @brief Number of requests that reused an open connection.
+     */
+    uint32_t reuses(void);
+
+    /**
+     * @brief Counters and latency histograms of a request type.
+     * @param tipo Request type (_domoTipos).
+     */
+    const S_DOMOSTATS &stats(uint8_t tipo);
+
+    /**
+     * @brief Dumps the counters and latency histograms of every request type.
+     * @param out Destination (Serial, a web response...).
+     */
+    void printStats(Print &out);
+
+    /**
+     * @brief Clears the counters and latency histograms.
+     */
+    void resetStats(void);
+};
+
+#endif // Domoticz_h
@@ -0,0 +1,280 @@
+/**
+ * @file Hardware.h
+ * @brief Hardware profile of the control box: pins, LEDs, buttons, zones and groups.
+ *
+ * Everything that depends on the wiring of the board is described here once.
+ * The _BOTONES list gives, for every input of the CD4021B chain and for the
+ * pseudo-buttons, its ID, LED, flags, description and the number of the zone
+ * or group it selects (0 if none). At compile time it generates:
+ * - Boton[] (Control.h).
+ * - ZONAS[] and GRUPOS[], ordered by zone / group number, with NUMZONAS and NUMGRUPOS.
+ * - The ID -> index tables of bID_bIndex() and bID_zIndex(), indexed by the bit
+ *   position of the ID (count trailing zeros).
+ * - The LED masks of the zones and the groups (LEDS_ZONAS, LEDS_GRUPOS).
+ *
+ * The length of both chains is part of the profile: CD4021B_BYTES registers of
+ * buttons and HC595_BYTES registers of LEDs. The masks of inputs / button IDs
+ * (inmask_t) and of LEDs (ledmask_t) are 16, 32 or 64 bit wide to fit them.
+ *
+ * static_asserts check that the profile is consistent, so a board with a
+ * different wiring only needs its own block in this file and costs nothing
+ * at runtime.
+ *
+ * @note This file is part of the ControlRiego-2.5 project.
+ */
+
+#ifndef Hardware_h
+#define Hardware_h
+
+#include <Arduino.h>
+#include <type_traits>
+
+//mascara mas pequeña con BITS bits (16, 32 o 64)
+template <int BITS> struct T_HWMASK {
+  typedef typename std::conditional<(BITS <= 16), uint16_t,
+          typename std::conditional<(BITS <= 32), uint32_t, uint64_t>::type>::type type;
+};
+
+#ifdef NODEMCU
+  #define ENCCLK                D0
+  #define ENCDT                 D1
+  #define ENCSW                 100
+  #define BUZZER                2
+  #define HC595_DATA            D8
+  #define HC595_LATCH           D4
+  #define HC595_CLOCK           D5
+  #define CD4021B_CLOCK         D5
+  #define CD4021B_LATCH         D6
+  #define CD4021B_DATA          D7
+  #define LEDR                  4
+  #define LEDG                  5
+  #define LEDB                  3
+  #define lGRUPO1               6
+  #define lGRUPO2               7
+  #define lGRUPO3               8
+  #define lZONA1                10
+  #define lZONA2                11
+  #define lZONA3                12
+  #define lZONA4                13
+  #define lZONA5                14
+  #define lZONA6                15
+  #define lZONA7                16
+  #define CD4021B_BYTES         2   // registros CD4021B en cascada (8 entradas cada uno)
+  #define HC595_BYTES           2   // registros 74HC595 en cascada con LEDs (8 LEDs cada uno)
+  #define HC595_EXTRA           1   // registros al final de la cadena que reciben copia del byte alto
+#endif
+
+#define IN_BITS     (CD4021B_BYTES * 8)
+#define LED_BITS    (HC595_BYTES * 8)
+static_assert(CD4021B_BYTES >= 1 && CD4021B_BYTES <= 8, "CD4021B_BYTES debe estar entre 1 y 8");
+static_assert(HC595_BYTES >= 1 && HC595_BYTES <= 8, "HC595_BYTES debe estar entre 1 y 8");
+typedef T_HWMASK<IN_BITS>::type inmask_t;     // entradas de la cadena CD4021B (ID de los botones)
+typedef T_HWMASK<LED_BITS>::type ledmask_t;   // frame de la cadena 74HC595
+
+#ifdef NODEMCU
+  //bit de cada boton en la cadena de CD4021B
+  enum _botones : inmask_t {
+    bZONA1      = 0x0001,
+    bZONA2      = 0x0002,
+    bZONA3      = 0x0004,
+    bZONA4      = 0x0008,
+    bZONA6      = 0x0010,
+    bMULTIRIEGO = 0x0020,
+    bZONA7      = 0x0040,
+    bZONA5      = 0x0080,
+    bSPARE13    = 0x0100,
+    bGRUPO3     = 0x0200,
+    bGRUPO1     = 0x0400,
+    bSTOP       = 0x0800,
+    bENCODER    = 0x1000,
+    bSPARE15    = 0x2000,
+    bSPARE16    = 0x4000,
+    bPAUSE      = 0x8000,
+  };
+
+  //Pseudobotones
+  #define bGRUPO2   0xFF01
+  #define bCONFIG   0xFF02
+
+  //tabla de botones: ID, LED, FLAGS, DESC, ZONA, GRUPO (numero de zona / grupo, 0 si no lo es)
+  #define _BOTONES(X) \
+    X(bZONA1,      lZONA1,   ENABLED | ACTION,               "ZONA1",      1, 0) \
+    X(bZONA2,      lZONA2,   ENABLED | ACTION,               "ZONA2",      2, 0) \
+    X(bZONA3,      lZONA3,   ENABLED | ACTION,               "ZONA3",      3, 0) \
+    X(bZONA4,      lZONA4,   ENABLED | ACTION,               "ZONA4",      4, 0) \
+    X(bZONA5,      lZONA5,   ENABLED | ACTION,               "ZONA5",      5, 0) \
+    X(bZONA6,      lZONA6,   ENABLED | ACTION,               "ZONA6",      6, 0) \
+    X(bZONA7,      lZONA7,   ENABLED | ACTION,               "ZONA7",      7, 0) \
+    X(bSPARE13,    0,        DISABLED,                       "spare13",    0, 0) \
+    X(bSPARE15,    0,        DISABLED,                       "spare15",    0, 0) \
+    X(bSPARE16,    0,        DISABLED,                       "spare16",    0, 0) \
+    X(bENCODER,    0,        ENABLED | ONLYSTATUS | DUAL,    "ENCODER",    0, 0) \
+    X(bMULTIRIEGO, 0,        ENABLED | ACTION,               "MULTIRIEGO", 0, 0) \
+    X(bGRUPO1,     lGRUPO1,  ENABLED | ONLYSTATUS | DUAL,    "GRUPO1",     0, 1) \
+    X(bGRUPO2,     lGRUPO2,  DISABLED,                       "GRUPO2",     0, 2) \
+    X(bGRUPO3,     lGRUPO3,  ENABLED | ONLYSTATUS | DUAL,    "GRUPO3",     0, 3) \
+    X(bPAUSE,      0,        ENABLED | ACTION | DUAL | HOLD, "PAUSE",      0, 0) \
+    X(bSTOP,       0,        ENABLED | ACTION | DUAL,        "STOP",       0, 0) \
+    X(bCONFIG,     0,        DISABLED,                       "CONFIG",     0, 0)
+#endif
+
+//----------------  generado a partir del perfil   ----------------------------------
+
+#define LEDBIT(id)  ((id) ? (ledmask_t)((ledmask_t)1 << ((id)-1)) : (ledmask_t)0)
+#define ZONABIT(i)  ((uint32_t)1 << (i))   // bit de la zona de indice i en las mascaras de zonas
+
+#define HW_ID(id, led, flags, desc, zona, grupo)      id,
+#define HW_LED(id, led, flags, desc, zona, grupo)     led,
+#define HW_ZONA(id, led, flags, desc, zona, grupo)    zona,
+#define HW_GRUPO(id, led, flags, desc, zona, grupo)   grupo,
+constexpr inmask_t HW_IDS[] = { _BOTONES(HW_ID) };
+constexpr uint8_t HW_LEDS[] = { _BOTONES(HW_LED) };
+constexpr uint8_t HW_ZONAS[] = { _BOTONES(HW_ZONA) };
+constexpr uint8_t HW_GRUPOS[] = { _BOTONES(HW_GRUPO) };
+#undef HW_ID
+#undef HW_LED
+#undef HW_ZONA
+#undef HW_GRUPO
+constexpr int NUM_HW_BOTONES = sizeof(HW_IDS)/sizeof(HW_IDS[0]);
+
+#define HW_PSEUDO_MAX   4       // pseudobotones 0xFF00..0xFF03
+#define HW_NO_INDEX     0xFF
+
+constexpr bool hwEsPseudo(inmask_t id) { return (id & ~(inmask_t)0xFF) == 0xFF00; }
+constexpr bool hwEsBit(inmask_t id) { return id && !(id & (id - 1)); }
+constexpr int hwBit(inmask_t id) { return __builtin_ctzll((unsigned long long)id); }
+
+constexpr int hwCuenta(const uint8_t *num)
+{
+  int n = 0;
+  for (int i = 0; i < NUM_HW_BOTONES; i++) if (num[i]) n++;
+  return n;
+}
+
+constexpr int NUMZONAS = hwCuenta(HW_ZONAS);     // numero de zonas (botones riego individual)
+constexpr int NUMGRUPOS = hwCuenta(HW_GRUPOS);   // numero de grupos multirriego
+static_assert(NUMZONAS <= 32, "las mascaras de zonas (ZONABIT) son de 32 bits");
+
+template <int N> struct T_HWLISTA { inmask_t id[N]; };
+
+//IDs de los botones ordenados por su numero de zona / grupo
+template <int N> constexpr T_HWLISTA<N> hwLista(const uint8_t *num)
+{
+  T_HWLISTA<N> t {};
+  for (int i = 0; i < NUM_HW_BOTONES; i++) if (num[i] && num[i] <= N) t.id[num[i] - 1] = HW_IDS[i];
+  return t;
+}
+
+constexpr T_HWLISTA<NUMZONAS> HW_LISTAZONAS = hwLista<NUMZONAS>(HW_ZONAS);
+constexpr T_HWLISTA<NUMGRUPOS> HW_LISTAGRUPOS = hwLista<NUMGRUPOS>(HW_GRUPOS);
+//una referencia no es const: sin static tendria enlace externo y se definiria en cada unidad
+static constexpr const inmask_t (&ZONAS)[NUMZONAS] = HW_LISTAZONAS.id;
+static constexpr const inmask_t (&GRUPOS)[NUMGRUPOS] = HW_LISTAGRUPOS.id;
+
+constexpr ledmask_t hwLeds(const uint8_t *num)
+{
+  ledmask_t mask = 0;
+  for (int i = 0; i < NUM_HW_BOTONES; i++) if (num[i]) mask |= LEDBIT(HW_LEDS[i]);
+  return mask;
+}
+
+constexpr ledmask_t LEDS_ZONAS = hwLeds(HW_ZONAS);     // LEDs de todas las zonas
+constexpr ledmask_t LEDS_GRUPOS = hwLeds(HW_GRUPOS);   // LEDs de todos los grupos
+
+struct T_HWINDICES {
+  uint8_t boton[IN_BITS];         // indice en Boton[] por posicion del bit del ID
+  uint8_t pseudo[HW_PSEUDO_MAX];  // indice en Boton[] de los pseudobotones
+  uint8_t zona[IN_BITS];          // indice en ZONAS[] por posicion del bit del ID
+};
+
+constexpr T_HWINDICES hwIndices()
+{
+  T_HWINDICES t {};
+  for (int b = 0; b < IN_BITS; b++) t.boton[b] = t.zona[b] = HW_NO_INDEX;
+  for (int p = 0; p < HW_PSEUDO_MAX; p++) t.pseudo[p] = HW_NO_INDEX;
+  for (int i = 0; i < NUM_HW_BOTONES; i++) {
+    if (hwEsPseudo(HW_IDS[i])) t.pseudo[(HW_IDS[i] & 0xFF) % HW_PSEUDO_MAX] = i;
+    else if (HW_IDS[i]) t.boton[hwBit(HW_IDS[i])] = i;
+  }
+  for (int i = 0; i < NUMZONAS; i++) if (ZONAS[i]) t.zona[hwBit(ZONAS[i])] = i;
+  return t;
+}
+
+constexpr T_HWINDICES HW_INDICES = hwIndices();
+
+/**
+ * @brief Gets the index of a button by its ID (constant when the ID is).
+ * @param id Button ID.
+ * @return Index of the button in Boton[], 999 if there is none.
+ */
+constexpr int bID_bIndex(inmask_t id)
+{
+  return hwEsPseudo(id) ? (((id & 0xFF) < HW_PSEUDO_MAX && HW_INDICES.pseudo[id & 0xFF] != HW_NO_INDEX) ? HW_INDICES.pseudo[id & 0xFF] : 999)
+       : !hwEsBit(id) ? 999
+       : (HW_INDICES.boton[hwBit(id)] != HW_NO_INDEX ? HW_INDICES.boton[hwBit(id)] : 999);
+}
+
+/**
+ * @brief Gets the index of a zone by its ID (constant when the ID is).
+ * @param id Zone ID.
+ * @return Index of the zone in ZONAS[], 999 if there is none.
+ */
+constexpr int bID_zIndex(inmask_t id)
+{
+  return !hwEsBit(id) ? 999
+       : (HW_INDICES.zona[hwBit(id)] != HW_NO_INDEX ? HW_INDICES.zona[hwBit(id)] : 999);
+}
+
+//----------------  comprobaciones del perfil   -------------------------------------
+
+constexpr bool hwIdsValidos()
+{
+  for (int i = 0; i < NUM_HW_BOTONES; i++) {
+    inmask_t id = HW_IDS[i];
+    if (hwEsPseudo(id) ? (id & 0xFF) >= HW_PSEUDO_MAX : !hwEsBit(id)) return false;
+    for (int j = 0; j < i; j++) if (HW_IDS[j] == id) return false;
+  }
+  return true;
+}
+
+//cada numero de 1 a N aparece una sola vez y ningun boton es a la vez zona y grupo
+constexpr bool hwNumeracion(const uint8_t *num, int n)
+{
+  for (int k = 1; k <= n; k++) {
+    int veces = 0;
+    for (int i = 0; i < NUM_HW_BOTONES; i++) if (num[i] == k) veces++;
+    if (veces != 1) return false;
+  }
+  for (int i = 0; i < NUM_HW_BOTONES; i++) if (HW_ZONAS[i] && HW_GRUPOS[i]) return false;
+  return true;
+}
+
+constexpr bool hwLedsValidos()
+{
+  for (int i = 0; i < NUM_HW_BOTONES; i++) {
+    uint8_t l = HW_LEDS[i];
+    if (HW_ZONAS[i] && (!l || hwEsPseudo(HW_IDS[i]))) return false;
+    if (!l) continue;
+    if (l > LED_BITS || l == LEDR || l == LEDG || l == LEDB || l == BUZZER) return false;
+    for (int j = 0; j < i; j++) if (HW_LEDS[j] == l) return false;
+  }
+  return true;
+}
+
+constexpr bool hwIndicesCorrectos()
+{
+  for (int i = 0; i < NUM_HW_BOTONES; i++) if (bID_bIndex(HW_IDS[i]) != i) return false;
+  for (int i = 0; i < NUMZONAS; i++) if (bID_zIndex(ZONAS[i]) != i) return false;
+  for (int i = 0; i < NUMGRUPOS; i++) if (bID_bIndex(GRUPOS[i]) == 999) return false;
+  return bID_bIndex(0) == 999 && bID_zIndex(0) == 999;
+}
+
+static_assert(NUM_HW_BOTONES < HW_NO_INDEX, "demasiados botones para las tablas de indices");
+static_assert(hwIdsValidos(), "los ID de _BOTONES deben ser un bit (o pseudoboton 0xFF0n) y no repetirse");
+static_assert(hwNumeracion(HW_ZONAS, NUMZONAS), "las zonas de _BOTONES deben numerarse 1..NUMZONAS sin repetirse");
+static_assert(hwNumeracion(HW_GRUPOS, NUMGRUPOS), "los grupos de _BOTONES deben numerarse 1..NUMGRUPOS sin repetirse");
+static_assert(hwLedsValidos(), "cada zona necesita un LED propio de la cadena, distinto de RGB y buzzer");
+static_assert(hwIndicesCorrectos(), "las tablas de bID_bIndex/bID_zIndex no devuelven el indice de cada boton");
+static_assert((LEDS_ZONAS & LEDS_GRUPOS) == 0, "LEDs de zonas y grupos solapados");
+
+#endif // Hardware_h
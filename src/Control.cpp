@@ -70,6 +70,7 @@ void setup()
    Serial.println(F("Inicializando Configure"));
   #endif
   configure = new Configure(display);
+  domoticz = new Domoticz(config.domoticz_ip, config.domoticz_port);
   initCD4021B();
   initHC595();
   setupInit();
@@ -80,6 +81,12 @@ void setup()
   setupParm();
   check();
   setupRedWM(config);
+  //la configuracion de Domoticz puede haber cambiado (fichero de parametros o portal)
+  domoticz->setServer(config.domoticz_ip, config.domoticz_port);
+  if (config.mqtt) domoMqtt = new DomoMqtt(strlen(config.mqtt_ip) ? config.mqtt_ip : config.domoticz_ip, config.mqtt_port, procesaCambioRemoto, procesaSinEco);
+  #ifdef WEBSERVER
+    setupNotify();
+  #endif
   if (saveConfig) {
     if (saveConfigFile(parmFile, config))  bipOK(3);;
     saveConfig = false;
@@ -89,8 +96,10 @@ void setup()
   delay(500);
   initClock();
   initLastRiegos();
-  initFactorRiegos();
+  //arranque inmediato con los factores guardados, se refrescan despues en STANDBY
+  if (!loadFactorsFile(factorsFile)) initFactorRiegos();
   Boton[bID_bIndex(bPAUSE)].flags.holddisabled = true;
+  tomaEntradas();
   parseInputs(CLEAR);
   setupEstado();
   #ifdef EXTRADEBUG
@@ -115,11 +124,18 @@ void loop()
     Serial.print(F("L"));
   #endif
 
+  tomaEntradas();
   procesaBotones();
   dimmerLeds();
   procesaEstados();
   dimmerLeds();
+  domoticz->service();
+  if (domoMqtt) domoMqtt->service();
+  #ifdef WEBSERVER
+    procesaNotify();
+  #endif
   Verificaciones();
+  flushLeds();
 }
 
   /*----------------------------------------------*
@@ -166,7 +182,7 @@ void procesaEstados()
   #ifdef EXTRATRACE
     Serial.print(F("E"));
   #endif
-
+  procesaFallosSwitch();
   switch (Estado.estado) {
     case CONFIGURANDO:
       procesaEstadoConfigurando();
@@ -204,7 +220,7 @@ void setupEstado()
   return;
   }
   if (NONETWORK) {
-    if (Boton[bID_bIndex(bSTOP)].estado) {
+    if (testButton(bSTOP, ON)) {
       setEstado(STOP);
       infoDisplay("StoP", NOBLINK, LONGBIP, 1);
     }
@@ -216,7 +232,7 @@ void setupEstado()
     return;
   }
   if (checkWifi()) {
-    if (Boton[bID_bIndex(bSTOP)].estado) {
+    if (testButton(bSTOP, ON)) {
       setEstado(STOP);
       infoDisplay("StoP", NOBLINK, LONGBIP, 1);
     }
@@ -231,6 +247,9 @@ void setupInit(void) {
   #ifdef TRACE
     Serial.println(F("TRACE: in setupInit"));
   #endif
+  //ledsISR acaba de arrancar: se espera a que haya filtrado las entradas
+  delay(5 * 1000 / INPUTS_SCANHZ);
+  tomaEntradas();
   if (testButton(bENCODER, OFF)) {
     if (testButton(bGRUPO1,ON)) {
       initFlags.initParm = true;
@@ -259,18 +278,19 @@ void procesaBotonPause(void)
         else {
           bip(1);
           setEstado(PAUSE);
-          tic_parpadeoLedZona.detach(); 
+          ledAnimStop(ANIM_ZONA);
           led(ultimoBoton->led,ON);
           stopRiego(ultimoBoton->id);
+          cierraAnterior();
+          cancelaSolape();
           T.PauseTimer();
         }
         break;
       case PAUSE:
         if(simular.ErrorPause) statusError(E2,3); 
-        else initRiego(ultimoBoton->id);
-        if(Estado.estado == ERROR) { 
-          ledID = ultimoBoton->led;
-          tic_parpadeoLedZona.attach(0.2,parpadeoLedZona);
+        //el fallo definitivo del On llega despues (procesaFallosSwitch); aqui solo los inmediatos
+        if(simular.ErrorPause || !initRiego(ultimoBoton->id)) { 
+          ledAnim(LEDBIT(ultimoBoton->led), 200, 200, 0, ANIM_ZONA);
           Serial.printf( "error al salir de PAUSE errorText : %s Estado.fase : %d\n", errorText, Estado.fase );
           refreshTime();
           setEstado(PAUSE);
@@ -278,7 +298,7 @@ void procesaBotonPause(void)
         }
         bip(2);
         T.ResumeTimer();
-        tic_parpadeoLedZona.detach(); 
+        ledAnimStop(ANIM_ZONA);
         led(ultimoBoton->led,ON);
         setEstado(REGANDO);
         break;
@@ -303,6 +323,7 @@ void procesaBotonPause(void)
           }
           else {  
             ultimosRiegos(SHOW);
+            flushLeds();
             delay(3000);
             ultimosRiegos(HIDE);
           }
@@ -329,6 +350,7 @@ void procesaBotonPause(void)
           }
           else {  
             Serial.println(F("Stop + encoderSW + PAUSA --> Reset....."));
+            domoticz->flush(DOMO_TIMEOUT);
             longbip(3);
             ESP.restart();  
           }
@@ -386,7 +408,7 @@ bool procesaBotonMultiriego(void)
     }  
     #ifdef DEBUG
       Serial.printf( "en MULTIRRIEGO, setMultibyId devuelve: Grupo%d (%s) multi.size=%d \n" , n_grupo, multi.desc, *multi.size);
-      for (int k=0; k < *multi.size; k++) Serial.printf( "       multi.serie: x%x \n" , multi.serie[k]);
+      for (int k=0; k < *multi.size; k++) Serial.printf( "       multi.serie: x%lx \n" , (unsigned long)multi.serie[k]);
       Serial.printf( "en MULTIRRIEGO, encoderSW status  : %d \n", encoderSW );
     #endif
     if (encoderSW) {
@@ -443,8 +465,13 @@ void procesaBotonZona(void)
         }
         T.SetTimer(0,fminutes,fseconds);
         T.StartTimer();
-        initRiego(boton->id);
-        if(Estado.estado != ERROR) setEstado(REGANDO); 
+        //con solape la zona ya se abrio mientras regaba la anterior
+        bool ok = multi.solapando || initRiego(boton->id);
+        multi.solapando = false;
+        if(ok) {
+          setEstado(REGANDO);
+          if(multirriego) preparaSiguiente();
+        }
     }
     else { 
       led(Boton[bIndex].led,ON);
@@ -456,6 +483,7 @@ void procesaBotonZona(void)
       savedValue = value;
       value = factorRiegos[zIndex];
       display->print(value);
+      flushLeds();
       delay(2000);
       value = savedValue; 
       led(Boton[bIndex].led,OFF);
@@ -498,6 +526,7 @@ void procesaEstadoConfigurando()
               Serial.println(F("[ConF] encoderSW + selector ABAJO: activamos AP y portal de configuracion"));
               ledConf(OFF);
               starConfigPortal(config);
+              domoticz->setServer(config.domoticz_ip, config.domoticz_port);
               ledConf(ON);
               display->print("ConF");
             }
@@ -585,7 +614,7 @@ void procesaEstadoConfigurando()
           break;
         default: 
           if (configure->configuringMulti()) {  
-            if (multi.w_size < 16) { 
+            if (multi.w_size < NUMZONAS) { 
               multi.serie[multi.w_size] = boton->id;
               Serial.printf("[ConF] añadiendo ZONA%d (%s) \n",zIndex+1, boton->desc);
               multi.w_size = multi.w_size + 1;
@@ -608,9 +637,12 @@ void procesaEstadoConfigurando()
 
 void procesaEstadoError(void)
 {
+  //un error a mitad de una transicion encadenada o de un solape no deja abierta otra zona
+  cierraAnterior();
+  cancelaSolape();
   if(boton == NULL) return; 
   if(boton->id == bPAUSE && boton->estado) { 
-    if (Boton[bID_bIndex(bSTOP)].estado) {
+    if (testButton(bSTOP, ON)) {
       setEstado(STOP);
       infoDisplay("StoP", NOBLINK, LONGBIP, 1);
       displayOff = true;
@@ -630,6 +662,7 @@ void procesaEstadoError(void)
   if(boton->id == bSTOP) {
     setEstado(STANDBY);
     if(checkWifi()) stopAllRiego();
+    domoticz->flush(DOMO_TIMEOUT);
     Serial.println(F("ERROR + STOP --> Reset....."));
     longbip(3);
     ESP.restart();  
@@ -639,24 +672,32 @@ void procesaEstadoError(void)
 
 void procesaEstadoRegando(void)
 {
+  bool ok;
   tiempoTerminado = T.Timer();
   if (T.TimeHasChanged()) refreshTime();
+  if (multirriego && config.solape && multi.siguiente && !multi.solapando && T.ShowTotalSeconds() <= config.solape) iniciaSolape();
+  //la zona anterior se cierra cuando el motor ha resuelto el On de esta (si falla, procesaFallosSwitch)
+  if (multi.cerrando && !domoticz->inFlight(ultimoBoton->idx)) cierraAnterior();
   if (tiempoTerminado == 0) setEstado(TERMINANDO);
-  else if(flagV && VERIFY) { 
-    if(queryStatus(ultimoBoton->idx, (char *)"On")) return;
+  else {
+    //mientras haya un reintento del On pendiente no se verifica el estado
+    if(flagV && VERIFY && !domoticz->retrying(ultimoBoton->idx)) queryStatus(ultimoBoton->idx, "On");
+    if(!statusVerified(ultimoBoton->idx, "On", &ok)) return;
+    if(ok) return;
     else {
-      ledID = ultimoBoton->led;
       if(Estado.fase == CERO) { 
         bip(1);
         T.PauseTimer();
-        tic_parpadeoLedZona.attach(0.8,parpadeoLedZona);
+        ledAnim(LEDBIT(ultimoBoton->led), 800, 800, 0, ANIM_ZONA);
+        cierraAnterior();
+        cancelaSolape();
         Serial.printf(">>>>>>>>>> procesaEstadoRegando zona: %s en PAUSA remota <<<<<<<<\n", ultimoBoton->desc);
         setEstado(PAUSE);
       }
       else {
         statusError(Estado.fase, 3); 
-        tic_parpadeoLedON.attach(0.2,parpadeoLedON);
-        tic_parpadeoLedZona.attach(0.4,parpadeoLedZona);
+        ledAnim(LEDBIT(LEDR), 200, 200, 0, ANIM_ON);
+        ledAnim(LEDBIT(ultimoBoton->led), 400, 400, 0, ANIM_ZONA);
         errorOFF = true;  
         Serial.println(F("[ERROR] procesaEstadoRegando: SE HA DEVUELTO ERROR"));
       }  
@@ -668,9 +709,26 @@ void procesaEstadoRegando(void)
 void procesaEstadoTerminando(void)
 {
   bip(5);
-  tic_parpadeoLedZona.detach(); 
-  stopRiego(ultimoBoton->id);
-  if (Estado.estado == ERROR) return; 
+  ledAnimStop(ANIM_ZONA);
+  cierraAnterior();
+  if (multirriego && multi.siguiente) {
+    //transicion encadenada sin pasar por STANDBY: sale el On de la siguiente zona y la actual
+    //queda en multi.cerrando hasta que el motor entregue el resultado de ese On
+    S_BOTON *anterior = ultimoBoton;
+    multi.actual = multi.proxima;
+    boton = multi.siguiente;
+    Serial.printf("MULTIRRIEGO %s: de %s a %s \n", multi.desc, anterior->desc, boton->desc);
+    setEstado(STANDBY);
+    procesaBotonZona();
+    if (Estado.estado == REGANDO) {
+      //la misma zona dos veces seguidas no se cierra
+      if (anterior != ultimoBoton) multi.cerrando = anterior;
+    }
+    //la siguiente no ha llegado a regar (su On no ha salido o no tiene tiempo): la anterior se cierra ya
+    else if (stopRiego(anterior->id)) led(anterior->led,OFF);
+    return;
+  }
+  if (!stopRiego(ultimoBoton->id)) return;
   display->blink(DEFAULTBLINK);
   led(Boton[bID_bIndex(ultimoBoton->id)].led,OFF);
   StaticTimeUpdate();
@@ -692,6 +750,58 @@ void procesaEstadoTerminando(void)
 };
 
 
+void preparaSiguiente(void)
+{
+  multi.siguiente = NULL;
+  //las zonas sin idx o con tiempo 0 se saltan
+  for (int i = multi.actual + 1; i < *multi.size; i++) {
+    S_BOTON *b = &Boton[bID_bIndex(multi.serie[i])];
+    int zIndex = bID_zIndex(b->id);
+    uint8_t fminutes=0,fseconds=0;
+    if (zIndex == 999) continue;
+    if (b->idx == 0) {
+      Serial.printf("MULTIRRIEGO: se salta %s (sin idx) \n", b->desc);
+      continue;
+    }
+    timeByFactor(factorRiegos[zIndex],&fminutes,&fseconds);
+    if (fminutes == 0 && fseconds == 0) {
+      Serial.printf("MULTIRRIEGO: se salta %s (tiempo 0) \n", b->desc);
+      continue;
+    }
+    multi.proxima = i;
+    multi.siguiente = b;
+    #ifdef DEBUG
+      Serial.printf("MULTIRRIEGO: preparada siguiente zona %s (idx %d, %d:%02d) \n", b->desc, b->idx, fminutes, fseconds);
+    #endif
+    return;
+  }
+}
+
+void iniciaSolape(void)
+{
+  Serial.printf("MULTIRRIEGO: solape de %d seg, abrimos %s \n", config.solape, multi.siguiente->desc);
+  multi.solapando = true;
+  initRiego(multi.siguiente->id);
+}
+
+void cierraAnterior(void)
+{
+  if (multi.cerrando == NULL) return;
+  S_BOTON *anterior = multi.cerrando;
+  multi.cerrando = NULL;
+  if (stopRiego(anterior->id)) led(anterior->led,OFF);
+}
+
+void cancelaSolape(void)
+{
+  if (!multi.solapando) return;
+  multi.solapando = false;
+  Serial.printf("MULTIRRIEGO: cancelado solape, cerramos %s \n", multi.siguiente->desc);
+  stopRiego(multi.siguiente->id);
+  led(multi.siguiente->led,OFF);
+}
+
+
 void procesaEstadoStandby(void)
 {
   Boton[bID_bIndex(bPAUSE)].flags.holddisabled = true;
@@ -719,14 +829,15 @@ void procesaEstadoStop(void)
 };
 
 void procesaEstadoPause(void) {
-  if(flagV && VERIFY) {  
-    if(queryStatus(ultimoBoton->idx, (char *)"Off")) return;
+  bool ok;
+  if(flagV && VERIFY && !domoticz->retrying(ultimoBoton->idx)) queryStatus(ultimoBoton->idx, "Off");
+  if(statusVerified(ultimoBoton->idx, "Off", &ok)) {  
+    if(ok) return;
     else {
       if(Estado.fase == CERO) { 
         bip(2);
-        ledID = ultimoBoton->led;
-        Serial.printf("\tactivado blink %s (boton id= %d) \n", ultimoBoton->desc, ultimoBoton->id);
-        tic_parpadeoLedZona.attach(0.8,parpadeoLedZona);
+        Serial.printf("\tactivado blink %s (boton id= %lu) \n", ultimoBoton->desc, (unsigned long)ultimoBoton->id);
+        ledAnim(LEDBIT(ultimoBoton->led), 800, 800, 0, ANIM_ZONA);
         Serial.printf(">>>>>>>>>> procesaEstadoPause zona: %s activada REMOTAMENTE <<<<<<<\n", ultimoBoton->desc);
         T.ResumeTimer();
         setEstado(REGANDO);
@@ -746,6 +857,83 @@ void setEstado(uint8_t estado)
   #endif
 }
 
+void setShadowDeseado(uint16_t idx, uint8_t estado)
+{
+  if(idx == 0) return;
+  for(uint i=0;i<NUMZONAS;i++) {
+    if(Boton[bID_bIndex(ZONAS[i])].idx != idx) continue;
+    shadow[i].deseado = estado;
+    shadow[i].tDeseado = millis();
+  }
+}
+
+void setShadowReportado(uint16_t idx, uint8_t estado, uint8_t origen)
+{
+  if(idx == 0) return;
+  for(uint i=0;i<NUMZONAS;i++) {
+    if(Boton[bID_bIndex(ZONAS[i])].idx != idx) continue;
+    shadow[i].reportado = estado;
+    shadow[i].tReportado = millis();
+    shadow[i].origen = origen;
+  }
+}
+
+void setShadowFallo(uint16_t idx, uint8_t orden, uint8_t fase)
+{
+  if(idx == 0) return;
+  for(uint i=0;i<NUMZONAS;i++) {
+    if(Boton[bID_bIndex(ZONAS[i])].idx != idx) continue;
+    shadow[i].fallo = fase;
+    shadow[i].falloOrden = orden;
+  }
+}
+
+bool shadowFresco(int zIndex)
+{
+  S_SHADOW *sh = &shadow[zIndex];
+  if(sh->reportado == ZONA_DESCONOCIDO) return false;
+  //una orden aun sin confirmar invalida el estado reportado
+  if(sh->deseado != ZONA_DESCONOCIDO && sh->deseado != sh->reportado) return false;
+  //un aviso de MQTT tampoco vale mas de shadowMaxAge: un mensaje de domoticz/out perdido no se nota
+  return (millis() - sh->tReportado < config.shadowMaxAge * 1000UL);
+}
+
+int shadowZona(uint16_t idx)
+{
+  if(idx == 0) return 999;
+  for(uint i=0;i<NUMZONAS;i++) {
+    if(Boton[bID_bIndex(ZONAS[i])].idx == idx) return i;
+  }
+  return 999;
+}
+
+void shadowInfo()
+{
+  const char *nZona[] = {"?", "Off", "On"};
+  const char *nOrigen[] = {"-", "lista", "status", "switch", "push"};
+  Serial.printf("Sombra local Domoticz (edad maxima %d s): \n", config.shadowMaxAge);
+  for(uint i=0;i<NUMZONAS;i++) {
+    Serial.printf("\tZONA%d idx %d: deseado %s reportado %s (%s, hace %lu s) \n", i+1, Boton[bID_bIndex(ZONAS[i])].idx,
+                  nZona[shadow[i].deseado], nZona[shadow[i].reportado], nOrigen[shadow[i].origen],
+                  (millis() - shadow[i].tReportado) / 1000);
+  }
+  Serial.printf("\tpeticiones evitadas: ordenes %lu verificaciones %lu \n", (unsigned long)shadowStats.switches, (unsigned long)shadowStats.status);
+  Serial.printf("\tconexiones: %lu reutilizadas: %lu \n", (unsigned long)domoticz->connects(), (unsigned long)domoticz->reuses());
+  if (domoMqtt) {
+    Serial.printf("\tMQTT %s: recibidos %lu publicados %lu sin eco %lu \n", domoMqtt->connected() ? "conectado" : "desconectado",
+                  (unsigned long)domoMqtt->received(), (unsigned long)domoMqtt->published(), (unsigned long)domoMqtt->lost());
+    if (shadowStats.remotos) Serial.printf("\tcambios remotos avisados: %lu, adelanto medio sobre el sondeo: %lu ms \n",
+                  (unsigned long)shadowStats.remotos, (unsigned long)(shadowStats.msAdelanto / shadowStats.remotos));
+  }
+}
+
+uint8_t estadoStatus(const char *status)
+{
+  if(strcmp(status, "On") == 0) return ZONA_ON;
+  if(strcmp(status, "Off") == 0) return ZONA_OFF;
+  return ZONA_DESCONOCIDO;
+}
+
 void check(void)
 {
   display->print("----");
@@ -760,34 +948,29 @@ void initFactorRiegos()
   #ifdef TRACE
     Serial.println(F("TRACE: in initFactorRiegos"));
   #endif
-  for(uint i=0;i<NUMZONAS;i++) {
-    factorRiegos[i]=100;
-  }
-  for(uint i=0;i<NUMZONAS;i++) 
-  {
-    int bIndex = bID_bIndex(ZONAS[i]);
-    uint factorR = getFactor(Boton[bIndex].idx);
-    if(factorR == 999) break; 
-    if(Estado.estado == ERROR) { 
-      if(Estado.fase == E3) {    
-        ledID = Boton[bIndex].led;
-        tic_parpadeoLedZona.attach(0.4,parpadeoLedZona);
-      }
-      break;
-    }
-    factorRiegos[i] = factorR;
-    if (strlen(descDomoticz)) {
-      if (xNAME) {
-        strlcpy(Boton[bIndex].desc, descDomoticz, sizeof(Boton[bIndex].desc));
-        Serial.printf("\tdescripcion ZONA%d actualizada en boton \n", i+1);
+  factorsCambiados = false;
+  if (!getFactors()) {
+    descDomoticz[0] = 0;
+    for(uint i=0;i<NUMZONAS;i++) setFactorZona(i, 100);
+    for(uint i=0;i<NUMZONAS;i++) 
+    {
+      int bIndex = bID_bIndex(ZONAS[i]);
+      uint factorR = getFactor(Boton[bIndex].idx);
+      if(factorR == 999) break; 
+      if(Estado.estado == ERROR) { 
+        if(Estado.fase == E3) {    
+          ledAnim(LEDBIT(Boton[bIndex].led), 400, 400, 0, ANIM_ZONA);
+        }
+        break;
       }
-      if (config.botonConfig[i].desc[0] == 0) {
-        strlcpy(config.botonConfig[i].desc, descDomoticz, sizeof(config.botonConfig[i].desc));
-        strlcpy(Boton[bIndex].desc, descDomoticz, sizeof(Boton[bIndex].desc));
-        Serial.printf("\tdescripcion ZONA%d incluida en config \n", i+1);
-      }  
+      setFactorZona(i, factorR);
     }
   }
+  if (factorRiegosOK) {
+    factorsRefresh = millis();
+    //factors.json solo se reescribe si algun factor o nombre ha cambiado
+    if (factorsCambiados) saveFactorsFile(factorsFile);
+  }
   #ifdef VERBOSE
     Serial.print(F("Factores de riego "));
     factorRiegosOK ? Serial.println(F("leidos: ")) :  Serial.println(F("(simulados): "));
@@ -798,6 +981,26 @@ void initFactorRiegos()
 }
 
 
+void setFactorZona(int i, uint factorR)
+{
+  int bIndex = bID_bIndex(ZONAS[i]);
+  if (factorRiegos[i] != factorR) factorsCambiados = true;
+  factorRiegos[i] = factorR;
+  if (strlen(descDomoticz)) {
+    if ((xNAME || config.botonConfig[i].desc[0] == 0) && strcmp(descDomoticz, Boton[bIndex].desc)) factorsCambiados = true;
+    if (xNAME) {
+      strlcpy(Boton[bIndex].desc, descDomoticz, sizeof(Boton[bIndex].desc));
+      Serial.printf("\tdescripcion ZONA%d actualizada en boton \n", i+1);
+    }
+    if (config.botonConfig[i].desc[0] == 0) {
+      strlcpy(config.botonConfig[i].desc, descDomoticz, sizeof(config.botonConfig[i].desc));
+      strlcpy(Boton[bIndex].desc, descDomoticz, sizeof(Boton[bIndex].desc));
+      Serial.printf("\tdescripcion ZONA%d incluida en config \n", i+1);
+    }  
+  }
+}
+
+
 void timeByFactor(int factor,uint8_t *fminutes, uint8_t *fseconds)
 {
   uint tseconds = (60*minutes) + seconds;
@@ -849,14 +1052,15 @@ void ultimosRiegos(int modo)
 
 void dimmerLeds()
 {
+  //el brillo lo aplica ledsISR, aqui solo se fija el nivel
+  uint8_t duty = reposo ? LEDS_DIMMED : LEDS_PWMSTEPS;
+  ledPWM(LEDR,duty);
+  ledPWM(LEDG,duty);
+  ledPWM(LEDB,duty);
   if (reposo) { 
-    led(LEDR,OFF);
-    led(LEDG,OFF);
-    led(LEDB,OFF);
-    delay(1);
     led(LEDR,ON);
-    if(connected) led(LEDG,ON);
-    if(NONETWORK) led(LEDB,ON);
+    led(LEDG,connected);
+    led(LEDB,NONETWORK);
   }   
 }
 
@@ -920,7 +1124,7 @@ void initLastRiegos()
 }
 
 
-bool initRiego(uint16_t id)
+bool initRiego(inmask_t id)
 {
   int bIndex = bID_bIndex(id);
   #ifdef DEBUG
@@ -937,37 +1141,31 @@ bool initRiego(uint16_t id)
   return domoticzSwitch(Boton[bIndex].idx, (char *)"On", DEFAULT_SWITCH_RETRIES);
 }
 
-bool stopRiego(uint16_t id)
+bool stopRiego(inmask_t id)
 {
   int bIndex = bID_bIndex(id);
-  ledID = Boton[bIndex].led;
   #ifdef DEBUG
   Serial.printf( "Terminando riego: %s \n", Boton[bIndex].desc);
   #endif
-  domoticzSwitch(Boton[bIndex].idx, (char *)"Off", DEFAULT_SWITCH_RETRIES);
-  if (Estado.estado != ERROR) Serial.printf( "Terminado OK riego: %s \n" , Boton[bIndex].desc );
-  else {     
-    if (!errorOFF) { 
-      errorOFF = true;  
-      tic_parpadeoLedON.attach(0.2,parpadeoLedON);
-      tic_parpadeoLedZona.attach(0.4,parpadeoLedZona);
-    } 
-    return false;
+  //false solo si la orden no ha podido salir; un fallo posterior lo trata procesaFallosSwitch
+  if (domoticzSwitch(Boton[bIndex].idx, (char *)"Off", DEFAULT_SWITCH_RETRIES)) {
+    Serial.printf( "Terminado OK riego: %s \n" , Boton[bIndex].desc );
+    return true;
   }
-  return true;
+  if (!errorOFF) { 
+    errorOFF = true;  
+    ledAnim(LEDBIT(LEDR), 200, 200, 0, ANIM_ON);
+    ledAnim(LEDBIT(Boton[bIndex].led), 400, 400, 0, ANIM_ZONA);
+  } 
+  return false;
 }
 
 
 void resetLeds()
 {
-  for(unsigned int j=0;j<NUMGRUPOS;j++) {
-    led(Boton[bID_bIndex(GRUPOS[j])].led,OFF);
-  }
-  tic_parpadeoLedZona.detach();
-  for(unsigned int i=0;i<NUMZONAS;i++) {
-    led(Boton[bID_bIndex(ZONAS[i])].led,OFF);
-  }
-  tic_parpadeoLedON.detach();
+  ledMask(LEDS_GRUPOS | LEDS_ZONAS, OFF);
+  ledAnimStop(ANIM_ZONA);
+  ledAnimStop(ANIM_ON);
   ledConf(OFF);
 }
 
@@ -976,6 +1174,9 @@ void resetFlags()
 {
   multirriego = false;
   multiSemaforo = false;
+  multi.siguiente = NULL;
+  multi.solapando = false;
+  multi.cerrando = NULL;
   errorOFF = false;
   falloAP = false;
   webServerAct = false;
@@ -983,24 +1184,76 @@ void resetFlags()
 }
 
 
+void stopConfirmado(uint16_t idx)
+{
+  if (!stopPendientes) return;
+  for(uint i=0;i<NUMZONAS;i++) {
+    if(Boton[bID_bIndex(ZONAS[i])].idx == idx) stopPendientes &= ~ZONABIT(i);
+  }
+  if (!stopPendientes) Serial.printf("STOP: Off confirmado en todas las zonas (%lu ms) \n", millis() - stopInicio);
+}
+
 bool stopAllRiego()
 {
   led(Boton[bID_bIndex(*multi.id)].led,OFF);
-  tic_parpadeoLedZona.detach();
+  ledAnimStop(ANIM_ZONA);
+  stopInicio = millis();
+  stopPendientes = 0;
+  grupoPendientes = 0;
+  //en un multirriego con grupo en Domoticz sus zonas se apagan con un unico switchscene
+  uint32_t enGrupo = 0;
+  bool fallo = false;
+  if(multirriego && *multi.idx && !NONETWORK) {
+    for(int j=0;j<*multi.size;j++) {
+      int zIndex = bID_zIndex(multi.serie[j]);
+      if(zIndex != 999) enGrupo |= ZONABIT(zIndex);
+    }
+  }
   for(unsigned int i=0;i<NUMZONAS;i++) {
-    led(Boton[bID_bIndex(ZONAS[i])].led,OFF);
-    if(!stopRiego(ZONAS[i])) return false; 
+    int bIndex = bID_bIndex(ZONAS[i]);
+    led(Boton[bIndex].led,OFF);
+    //solo se omite el Off de las zonas que Domoticz ha confirmado apagadas hace poco (shadowMaxAge):
+    //un STOP no puede fiarse de un Off viejo o de un aviso perdido. Los Off salen en paralelo
+    if(shadow[i].reportado == ZONA_OFF && shadow[i].deseado != ZONA_ON && shadowFresco(i)) continue;
+    if(Boton[bIndex].idx && !NONETWORK) stopPendientes |= ZONABIT(i);
+    if(enGrupo & ZONABIT(i)) {
+      if(Boton[bIndex].idx) grupoPendientes |= ZONABIT(i);
+      continue;
+    }
+    //con la cola llena se atiende el motor hasta que quepa el Off: un STOP no deja zonas sin Off
+    domoticz->room(DOMO_TIMEOUT);
+    if(!stopRiego(ZONAS[i])) {
+      stopPendientes &= ~ZONABIT(i);
+      fallo = true;
+    }
+  }
+  if(grupoPendientes) {
+    domoticz->room(DOMO_TIMEOUT);
+    if(!domoticzScene(*multi.idx, "Off")) stopZonas(grupoPendientes);
+  }
+  #ifdef DEBUG
+    Serial.printf("STOP: Off enviado a zonas 0x%x (0x%x con el grupo) \n", stopPendientes, grupoPendientes);
+  #endif
+  return !fallo;
+}
+
+void stopZonas(uint32_t mask)
+{
+  grupoPendientes &= ~mask;
+  for(unsigned int i=0;i<NUMZONAS;i++) {
+    if(!(mask & stopPendientes & ZONABIT(i))) continue;
+    domoticz->room(DOMO_TIMEOUT);
+    stopRiego(ZONAS[i]);
   }
-  return true;
 }
 
 
 void bip(int veces)
 {
   for (int i=0; i<veces;i++) {
-    led(BUZZER,ON);
+    buzzer(ON);
     delay(50);
-    led(BUZZER,OFF);
+    buzzer(OFF);
     delay(50);
   }
 }
@@ -1009,9 +1262,9 @@ void bip(int veces)
 void longbip(int veces)
 {
   for (int i=0; i<veces;i++) {
-    led(BUZZER,ON);
+    buzzer(ON);
     delay(750);
-    led(BUZZER,OFF);
+    buzzer(OFF);
     delay(100);
   }
 }
@@ -1019,9 +1272,9 @@ void longbip(int veces)
 
 void bipOK(int veces)
 {
-    led(BUZZER,ON);
+    buzzer(ON);
     delay(500);
-    led(BUZZER,OFF);
+    buzzer(OFF);
     delay(100);
     bip(veces);
 }
@@ -1029,15 +1282,15 @@ void bipOK(int veces)
 
 void bipEND(int veces)
 {
-    led(BUZZER,ON);
+    buzzer(ON);
     delay(500);
-    led(BUZZER,OFF);
+    buzzer(OFF);
     delay(100);
     bip(veces);
     delay(100);
-    led(BUZZER,ON);
+    buzzer(ON);
     delay(500);
-    led(BUZZER,OFF);
+    buzzer(OFF);
 }
 
 
@@ -1107,47 +1360,192 @@ void infoDisplay(const char *textDisplay, int dnum, int btype, int bnum) {
   display->blink(dnum);
 }
 
-String httpGetDomoticz(String message) 
+bool getFactors()
 {
   #ifdef TRACE
-    Serial.println(F("TRACE: in httpGetDomoticz"));
+    Serial.println(F("TRACE: in getFactors"));
   #endif
-  String tmpStr = "http://" + String(config.domoticz_ip) + ":" + config.domoticz_port + String(message);
+  factorRiegosOK = false;
+  if(NONETWORK || !checkWifi()) return false;
+  zonasLeidas = 0;
+  //cada dispositivo de la lista se procesa en getFactorsItem segun se recibe
+  char message[DOMO_PATHSIZE];
+  snprintf_P(message, sizeof(message), DOMO_URL_LIGHTS);
+  if (domoticz->get(message, DOMO_FACTORS, 0, getFactorsItem) != DOMO_OK) return false;
+  factorRiegosOK = checkZonasLeidas();
+  return true;
+}
+
+bool checkZonasLeidas()
+{
+  descDomoticz[0] = 0;
+  for(uint i=0;i<NUMZONAS;i++) {
+    int bIndex = bID_bIndex(ZONAS[i]);
+    if(Boton[bIndex].idx == 0) {
+      setFactorZona(i, 0);
+      continue;
+    }
+    if(zonasLeidas & ZONABIT(i)) continue;
+    #ifdef VERBOSE
+      Serial.printf("El idx %d no se ha encontrado en la lista de dispositivos\n",Boton[bIndex].idx);
+    #endif
+    if(VERIFY) {
+      statusError(E3,3);
+      ledAnim(LEDBIT(Boton[bIndex].led), 400, 400, 0, ANIM_ZONA);
+      return false;
+    }
+    setFactorZona(i, 100);
+  }
+  return true;
+}
+
+void getFactorsItem(S_DOMOREQ *req, int rc, JsonDocument &device)
+{
+  if (rc != DOMO_ITEM) {
+    //fin de un refresco en segundo plano (refreshFactors)
+    factorsPending = false;
+    if (rc != DOMO_OK) return;
+    //como en el arranque: una zona configurada que no esta en la lista es E3
+    if (!checkZonasLeidas()) {
+      factorRiegosOK = false;
+      return;
+    }
+    factorRiegosOK = true;
+    factorsRefresh = millis();
+    if (factorsCambiados) saveFactorsFile(factorsFile);
+    return;
+  }
+  uint16_t idx = atoi(device["idx"] | "0");
+  if(idx == 0) return;
+  for(uint i=0;i<NUMZONAS;i++) {
+    int bIndex = bID_bIndex(ZONAS[i]);
+    if(Boton[bIndex].idx != idx) continue;
+    descDomoticz[0] = 0;
+    #ifdef xNAME
+      strlcpy(descDomoticz, device["Name"] | "", sizeof(descDomoticz));
+    #endif  
+    uint factorR = factorDesc(device["Description"] | "");
+    setFactorZona(i, factorR);
+    setShadowReportado(idx, estadoStatus(device["Status"] | ""), SH_LISTA);
+    zonasLeidas |= ZONABIT(i);
+  }
+}
+
+void refreshFactors()
+{
+  if(factorsPending || NONETWORK) return;
+  //se refresca a mitad del TTL para que un multirriego nunca use factores mas antiguos
+  if(factorRiegosOK && millis() - factorsRefresh < FACTORS_TTL * 500UL) return;
   #ifdef DEBUG
-    Serial.print(F("TMPSTR: "));Serial.println(tmpStr);
+    Serial.println(F("refrescando factores de riego en segundo plano"));
   #endif
-  httpclient.begin(client, tmpStr);
-  String response = "{}";
-  int httpCode = httpclient.GET();
-  if(httpCode > 0) {
-    if(httpCode == HTTP_CODE_OK) {
-      response = httpclient.getString();
-      #ifdef EXTRADEBUG1
-        Serial.print(F("httpGetDomoticz RESPONSE: "));Serial.println(response);
-      #endif
-    }
+  zonasLeidas = 0;
+  factorsCambiados = false;
+  char message[DOMO_PATHSIZE];
+  snprintf_P(message, sizeof(message), DOMO_URL_LIGHTS);
+  factorsPending = domoticz->request(message, DOMO_FACTORS, 0, getFactorsItem);
+}
+
+bool saveFactorsFile(const char *p_filename)
+{
+  #ifdef TRACE
+    Serial.println(F("TRACE: in saveFactorsFile"));
+  #endif
+  if(!LittleFS.begin()){
+    Serial.println(F("An Error has occurred while mounting LittleFS"));
+    return false;
   }
-  else {
-    if(Estado.estado != ERROR) {
-      Serial.printf("[ERROR] httpGetDomoticz: ERROR comunicando con Domoticz error: %s\n", httpclient.errorToString(httpCode).c_str()); 
+  File file = LittleFS.open(p_filename, "w");
+  if(!file){
+    Serial.println(F("Failed to open file for writing"));
+    return false;
+  }
+  DynamicJsonDocument doc(1024);
+  doc["time"] = timeOK ? (unsigned long)timeClient.getEpochTime() : 0UL;
+  JsonArray array_zonas = doc.createNestedArray("zonas");
+  for (int i=0; i<NUMZONAS; i++) {
+    int bIndex = bID_bIndex(ZONAS[i]);
+    array_zonas[i]["idx"]    = Boton[bIndex].idx;
+    array_zonas[i]["factor"] = factorRiegos[i];
+    array_zonas[i]["nombre"] = Boton[bIndex].desc;
+  }
+  if (serializeJson(doc, file) == 0) Serial.println(F("Failed to write to file"));
+  file.close();
+  LittleFS.end();
+  #ifdef DEBUG
+    Serial.printf("factores de riego guardados en %s \n", p_filename);
+  #endif
+  return true;
+}
+
+bool loadFactorsFile(const char *p_filename)
+{
+  #ifdef TRACE
+    Serial.println(F("TRACE: in loadFactorsFile"));
+  #endif
+  if(!LittleFS.begin()){
+    Serial.println(F("An Error has occurred while mounting LittleFS"));
+    return false;
+  }
+  File file = LittleFS.open(p_filename, "r");
+  if(!file) {
+    LittleFS.end();
+    return false;
+  }
+  DynamicJsonDocument doc(1024);
+  DeserializationError error = deserializeJson(doc, file);
+  file.close();
+  LittleFS.end();
+  if (error) {
+    Serial.print(F("[ERROR] loadFactorsFile: deserializeJson() failed: "));
+    Serial.println(error.f_str());
+    return false;
+  }
+  JsonArray array_zonas = doc["zonas"];
+  if (array_zonas.size() != (size_t)NUMZONAS) return false;
+  //la cache solo vale si corresponde a los idx configurados
+  for (int i=0; i<NUMZONAS; i++) {
+    if ((array_zonas[i]["idx"] | 0) != Boton[bID_bIndex(ZONAS[i])].idx) {
+      Serial.println(F("cache de factores de riego no corresponde a la configuracion"));
+      return false;
     }
-    return "Err2";
   }
-  int pos = response.indexOf("\"status\" : \"ERR");
-  if(pos != -1) {
-    Serial.println(F("[ERROR] httpGetDomoticz: SE HA DEVUELTO ERROR")); 
-    return "ErrX";
+  for (int i=0; i<NUMZONAS; i++) {
+    strlcpy(descDomoticz, array_zonas[i]["nombre"] | "", sizeof(descDomoticz));
+    setFactorZona(i, array_zonas[i]["factor"] | 100);
   }
-  httpclient.end();
-  return response;
+  factorRiegosOK = true;
+  //edad de la cache: si no se conoce se refresca en cuanto haya red
+  unsigned long cacheTime = doc["time"] | 0UL;
+  unsigned long age = FACTORS_TTL;
+  if (cacheTime && timeOK && timeClient.getEpochTime() >= cacheTime) age = timeClient.getEpochTime() - cacheTime;
+  if (age > FACTORS_TTL) age = FACTORS_TTL;
+  factorsRefresh = millis() - age * 1000UL;
+  #ifdef VERBOSE
+    Serial.printf("Factores de riego leidos de %s (hace %lu s): \n", p_filename, age);
+    for(uint i=0;i<NUMZONAS;i++) {
+      Serial.printf("\tfactor ZONA%d: %d (%s) \n", i+1, factorRiegos[i], Boton[bID_bIndex(ZONAS[i])].desc);
+    }
+  #endif
+  return true;
 }
 
+int factorDesc(const char *factorstr)
+{
+  long int factor = strtol(factorstr,NULL,10);
+  if (factor == 0) {
+    if (strlen(factorstr) == 0) return 100;   
+    if (!isdigit(factorstr[0])) return 100;   
+  }
+  return (int)factor;
+}
 
 int getFactor(uint16_t idx)
 {
   #ifdef TRACE
     Serial.println(F("TRACE: in getFactor"));
   #endif
+  descDomoticz[0] = 0;
   if(idx == 0) return 0;
   factorRiegosOK = false;
   if(!checkWifi()) {
@@ -1157,35 +1555,29 @@ int getFactor(uint16_t idx)
       return 100;
     }
   }
-  char JSONMSG[200]="/json.htm?type=devices&rid=%d";
-  char message[250];
-  sprintf(message,JSONMSG,idx);
-  String response = httpGetDomoticz(message);
-  if (response.startsWith("Err")) {
+  char message[DOMO_PATHSIZE];
+  snprintf_P(message, sizeof(message), DOMO_URL_DEVICE, idx);
+  int rc = domoticz->get(message, DOMO_FACTOR, idx);
+  if (rc == DOMO_ERR2 || rc == DOMO_ERRX) {
     if (NONETWORK) { 
       setEstado(STANDBY);
       return 999;
     }
-    if(response == "ErrX") statusError(E3,3);
+    if(rc == DOMO_ERRX) statusError(E3,3);
     else statusError(E2,3);
     #ifdef DEBUG
       Serial.printf("GETFACTOR IDX: %d [HTTP] GET... failed\n", idx);
     #endif
     return 100;
   }
-
-  char* response_pointer = &response[0];
-  DynamicJsonDocument jsondoc(2048);
-  DeserializationError error = deserializeJson(jsondoc, response_pointer);
-  if (error) {
-    Serial.print(F("[ERROR] getFactor: deserializeJson() failed: "));
-    Serial.println(error.f_str());
+  if (rc == DOMO_ERRJSON) {
     if(!VERIFY) return 100;
     else {
       statusError(E2,3); 
       return 100;
     }
   }
+  JsonDocument &jsondoc = domoticz->doc();
   const char *factorstr = jsondoc["result"][0]["Description"];
   if(factorstr == NULL) {
     #ifdef VERBOSE
@@ -1201,70 +1593,199 @@ int getFactor(uint16_t idx)
     strlcpy(descDomoticz, jsondoc["result"][0]["Name"] | "", sizeof(descDomoticz));
   #endif  
   factorRiegosOK = true;
-  long int factor = strtol(factorstr,NULL,10);
-  if (factor == 0) {
-    if (strlen(factorstr) == 0) return 100;   
-    if (!isdigit(factorstr[0])) return 100;   
+  return factorDesc(factorstr);
+}
+
+void queryGrupo(uint16_t idx)
+{
+  char message[DOMO_PATHSIZE];
+  snprintf_P(message, sizeof(message), DOMO_URL_SCENES);
+  if (!domoticz->request(message, DOMO_SCENES, idx, queryGrupoItem)) stopZonas(grupoPendientes);
+}
+
+void queryGrupoItem(S_DOMOREQ *req, int rc, JsonDocument &scene)
+{
+  if (rc != DOMO_ITEM) {
+    //lista terminada sin encontrar el grupo (o con error): se sigue zona a zona
+    if (grupoPendientes) stopZonas(grupoPendientes);
+    return;
   }
-  return (int)factor;
+  if (!grupoPendientes || atoi(scene["idx"] | "0") != req->idx) return;
+  const char *status = scene["Status"] | "";
+  #ifdef DEBUG
+    Serial.printf("DOMOTICZSCENE IDX: %d status %s \n", req->idx, status);
+  #endif
+  if (strcmp(status, "Off") != 0) {
+    //alguna zona del grupo sigue regando (Mixed): se apagan una a una
+    stopZonas(grupoPendientes);
+    return;
+  }
+  for(uint i=0;i<NUMZONAS;i++) {
+    if(!(grupoPendientes & ZONABIT(i))) continue;
+    uint16_t idx = Boton[bID_bIndex(ZONAS[i])].idx;
+    setShadowReportado(idx, ZONA_OFF, SH_STATUS);
+    stopConfirmado(idx);
+  }
+  grupoPendientes = 0;
 }
 
-bool queryStatus(uint16_t idx, char *status)
+void queryStatus(uint16_t idx, const char *status, bool consulta)
 {
   #ifdef TRACE
     Serial.println(F("TRACE: in queryStatus"));
   #endif
+  if(verify.pending) return;
+  verify.idx = idx;
+  strlcpy(verify.status, status, sizeof(verify.status));
+  verify.done = false;
   if(!checkWifi()) {
-    if(NONETWORK) return true; 
-    else {
-      Estado.fase=E1;
-      return false;
-    }
+    verify.ok = NONETWORK;
+    verify.fase = E1;
+    verify.done = true;
+    return;
   }
-  char JSONMSG[200]="/json.htm?type=devices&rid=%d";
-  char message[250];
-  sprintf(message,JSONMSG,idx);
-  String response = httpGetDomoticz(message);
-  if (response.startsWith("Err")) {
-    if (NONETWORK) return true;  
-    if(response == "ErrX") Estado.fase=E3;
-    else Estado.fase=E2;
-    Serial.printf("[ERROR] queryStatus IDX: %d [HTTP] GET... failed\n", idx);
-    return false;
+  int zIndex = shadowZona(idx);
+  if(zIndex != 999 && !consulta && shadowFresco(zIndex)) {
+    //la sombra local es reciente: se verifica sin consultar Domoticz
+    const char *nZona[] = {"", "Off", "On"};
+    shadowStats.status++;
+    verify.done = true;
+    queryStatusResult(nZona[shadow[zIndex].reportado]);
+    return;
   }
-  char* response_pointer = &response[0];
-  DynamicJsonDocument jsondoc(2048);
-  DeserializationError error = deserializeJson(jsondoc, response_pointer);
-  if (error) {
-    Serial.print(F("[ERROR] queryStatus: deserializeJson() failed: "));
-    Serial.println(error.f_str());
-    Estado.fase=E2;  
-    return false;
+  char message[DOMO_PATHSIZE];
+  //si ya conocemos el estado de esta zona solo pedimos los cambios desde la ultima lectura
+  verify.delta = (verify.actTime && verify.lastIdx == idx);
+  if(verify.delta) snprintf_P(message, sizeof(message), DOMO_URL_DEVICEDELTA, idx, (unsigned long)verify.actTime);
+  else snprintf_P(message, sizeof(message), DOMO_URL_DEVICE, idx);
+  verify.pending = domoticz->request(message, DOMO_STATUS, idx, queryStatusCallback);
+}
+
+void queryStatusCallback(S_DOMOREQ *req, int rc, JsonDocument &jsondoc)
+{
+  verify.pending = false;
+  verify.done = true;
+  verify.ok = false;
+  if (rc != DOMO_OK) verify.actTime = 0;
+  if (rc == DOMO_ERR2 || rc == DOMO_ERRX) {
+    verify.ok = NONETWORK;
+    if(rc == DOMO_ERRX) verify.fase=E3;
+    else verify.fase=E2;
+    Serial.printf("[ERROR] queryStatus IDX: %d [HTTP] GET... failed\n", req->idx);
+    return;
+  }
+  if (rc == DOMO_ERRJSON) {
+    verify.fase=E2;  
+    return;
   }
   const char *actual_status = jsondoc["result"][0]["Status"];
+  if(actual_status == NULL && verify.delta) {
+    //sin result: el dispositivo no ha cambiado desde la ultima lectura
+    actual_status = verify.lastStatus;
+    verify.sinCambios++;
+  }
   if(actual_status == NULL) {
     Serial.print(F("[ERROR] queryStatus: deserializeJson() failed: Status not found"));
-    Estado.fase=E2;  
-    return false;
+    verify.fase=E2;  
+    verify.actTime = 0;
+    return;
   }
+  if(actual_status != verify.lastStatus) strlcpy(verify.lastStatus, actual_status, sizeof(verify.lastStatus));
+  setShadowReportado(req->idx, estadoStatus(actual_status), SH_STATUS);
+  verify.lastIdx = req->idx;
+  verify.actTime = jsondoc["ActTime"] | 0;
   #ifdef EXTRADEBUG
-    Serial.printf( "queryStatus verificando, status=%s / actual=%s \n" , status, actual_status);
-    Serial.printf( "                status_size=%d / actual_size=%d \n" , strlen(status), strlen(actual_status));
+    Serial.printf( "                ActTime=%lu sondeos sin cambios=%lu \n" , (unsigned long)verify.actTime, (unsigned long)verify.sinCambios);
   #endif
+  queryStatusResult(actual_status);
+}
+
+void queryStatusResult(const char *actual_status)
+{
+  #ifdef EXTRADEBUG
+    Serial.printf( "queryStatus verificando, status=%s / actual=%s \n" , verify.status, actual_status);
+    Serial.printf( "                status_size=%d / actual_size=%d \n" , strlen(verify.status), strlen(actual_status));
+  #endif
+  verify.ok = false;
+  verify.fase = CERO;
   if(simular.ErrorVerifyON) {  
-    if(strcmp(status, "On")==0) return false; else return true; 
+    verify.ok = (strcmp(verify.status, "On") != 0);
+    return;
   } 
   if(simular.ErrorVerifyOFF) {  
-    if(strcmp(status, "Off")==0) return false; else return true; 
+    verify.ok = (strcmp(verify.status, "Off") != 0);
+    return;
   } 
-  if(strcmp(actual_status,status) == 0) return true;
-  else{
-    if(NONETWORK) return true; 
-    #ifdef DEBUG
-      Serial.print(F("queryStatus devuelve FALSE, status / actual = "));Serial.print(status);Serial.println(actual_status);
-    #endif
-    return false;
-  }  
+  if(strcmp(actual_status,verify.status) == 0 || NONETWORK) verify.ok = true;
+  #ifdef DEBUG
+    else {
+      Serial.print(F("queryStatus devuelve FALSE, status / actual = "));Serial.print(verify.status);Serial.println(actual_status);
+    }
+  #endif
+}
+
+bool statusVerified(uint16_t idx, const char *status, bool *ok)
+{
+  if(!verify.done) return false;
+  verify.done = false;
+  if(verify.idx != idx || strcmp(verify.status, status) != 0) return false;
+  *ok = verify.ok;
+  if(!verify.ok) Estado.fase = verify.fase;
+  return true;
+}
+
+void procesaCambioRemoto(uint16_t idx, bool on)
+{
+  int zIndex = shadowZona(idx);
+  if(zIndex == 999) return;
+  S_SHADOW *sh = &shadow[zIndex];
+  uint8_t estado = on ? ZONA_ON : ZONA_OFF;
+  //eco de una orden nuestra, o de una anterior aun en vuelo
+  bool propio = (sh->deseado == estado) ||
+                (sh->deseado != ZONA_DESCONOCIDO && sh->deseado != sh->reportado && millis() - sh->tDeseado < DOMO_TIMEOUT);
+  setShadowReportado(idx, estado, SH_PUSH);
+  if(!on) stopConfirmado(idx);
+  if(propio) return;
+  Serial.printf("PUSH: cambio remoto idx %d a %s \n", idx, on ? "On" : "Off");
+  if((Estado.estado != REGANDO && Estado.estado != PAUSE) || ultimoBoton == NULL || ultimoBoton->idx != idx) return;
+  if(verify.pending) return;
+  //el sondeo lo habria visto en la siguiente ronda de verificaciones
+  unsigned long sondeo = tFlagV + VERIFY_INTERVAL * 1000UL;
+  unsigned long adelanto = ((long)(sondeo - millis()) > 0) ? sondeo - millis() : 0;
+  shadowStats.remotos++;
+  shadowStats.msAdelanto += adelanto;
+  #ifdef DEBUG
+    Serial.printf("PUSH: detectado %lu ms antes que por sondeo \n", adelanto);
+  #endif
+  //se entrega como resultado de verificacion a procesaEstadoRegando / procesaEstadoPause
+  verify.idx = idx;
+  strlcpy(verify.status, (Estado.estado == REGANDO) ? "On" : "Off", sizeof(verify.status));
+  verify.done = true;
+  queryStatusResult(on ? "On" : "Off");
+}
+
+void procesaAviso(uint16_t idx)
+{
+  //cualquiera en la red puede llamar a /notify: el aviso solo adelanta la verificacion de la zona en curso
+  if((Estado.estado != REGANDO && Estado.estado != PAUSE) || ultimoBoton == NULL || ultimoBoton->idx != idx) return;
+  if(verify.pending || domoticz->retrying(idx)) return;
+  #ifdef DEBUG
+    Serial.printf("NOTIFY: aviso de cambio idx %d, se consulta a Domoticz \n", idx);
+  #endif
+  queryStatus(idx, (Estado.estado == REGANDO) ? "On" : "Off", true);
+}
+
+void procesaSinEco(uint16_t idx, bool on)
+{
+  int zIndex = shadowZona(idx);
+  uint8_t estado = on ? ZONA_ON : ZONA_OFF;
+  //una orden posterior para la zona ya ha salido por otro camino
+  if(zIndex != 999 && shadow[zIndex].deseado != estado) return;
+  Serial.printf("DOMOTICZSWITH IDX: %d sin confirmar por MQTT, se envia %s por HTTP \n", idx, on ? "On" : "Off");
+  char message[DOMO_PATHSIZE];
+  snprintf_P(message, sizeof(message), DOMO_URL_SWITCH, idx, on ? "On" : "Off");
+  //si tampoco sale por HTTP se trata como cualquier orden fallida (procesaFallosSwitch)
+  if(!domoticz->request(message, DOMO_SWITCH, idx, domoticzSwitchCallback, DEFAULT_SWITCH_RETRIES-1)) setShadowFallo(idx, estado, E2);
 }
 
 bool domoticzSwitch(int idx, char *msg, int retries)
@@ -1277,38 +1798,121 @@ bool domoticzSwitch(int idx, char *msg, int retries)
     statusError(E1,3);
     return false;
   }
-  char JSONMSG[200]="/json.htm?type=command&param=switchlight&idx=%d&switchcmd=%s";
-  char message[250];
-  sprintf(message,JSONMSG,idx,msg);
-  String response;
-  for(int i=0; i<retries; i++) {
-     if ((simular.ErrorON && strcmp(msg,"On")==0) || (simular.ErrorOFF && strcmp(msg,"Off")==0)) response = "ErrX"; 
-     else if(!NONETWORK) response = httpGetDomoticz(message); 
-     if(response == "ErrX") { 
-       bip(1);
-       Serial.printf("DOMOTICZSWITH IDX: %d fallo en %s (intento %d de %d)\n", idx, msg, i+1, retries);
-       delay(DELAYRETRY);
-     }
-     else break;
-  }   
-  if (response.startsWith("Err")) {
-    if (!errorOFF) {
-      if(response == "ErrX") {
-        if(strcmp(msg,"On") == 0 ) statusError(E4,3); 
-        else statusError(E5,5); 
-      }
-      else statusError(E2,3); 
-    }
-    Serial.printf("DOMOTICZSWITH IDX: %d fallo en %s\n", idx, msg);
+  char message[DOMO_PATHSIZE];
+  snprintf_P(message, sizeof(message), DOMO_URL_SWITCH, idx, msg);
+  if ((simular.ErrorON && strcmp(msg,"On")==0) || (simular.ErrorOFF && strcmp(msg,"Off")==0)) {
+    S_DOMOREQ req;
+    strlcpy(req.path, message, sizeof(req.path));
+    req.idx = idx;
+    //como un fallo del motor: la orden se acepta y el error llega en la siguiente pasada
+    domoticzSwitchCallback(&req, DOMO_ERRX, domoticz->doc());
+    return true;
+  }
+  if(NONETWORK) return true;
+  int zIndex = shadowZona(idx);
+  if(zIndex != 999 && shadowFresco(zIndex) && shadow[zIndex].reportado == estadoStatus(msg)) {
+    //Domoticz ya confirmo ese estado hace poco: orden redundante
+    shadowStats.switches++;
+    #ifdef DEBUG
+      Serial.printf("DOMOTICZSWITH IDX: %d ya esta en %s, no se envia \n", idx, msg);
+    #endif
+    return true;
+  }
+  //con MQTT la orden se publica en domoticz/in y la confirmacion llega por domoticz/out;
+  //sin ella en MQTT_ACKTIMEOUT ms la orden se repite por HTTP (procesaSinEco)
+  if(domoMqtt && domoMqtt->switchLight(idx, msg)) {
+    domoticz->cancel(idx);
+    setShadowDeseado(idx, estadoStatus(msg));
+    return true;
+  }
+  //los reintentos los programa el motor Domoticz sin bloquear el loop
+  if(!domoticz->request(message, DOMO_SWITCH, idx, domoticzSwitchCallback, (retries > 1) ? retries-1 : 0)) {
+    if (!errorOFF) statusError(E2,3);
     return false;
   }
+  setShadowDeseado(idx, estadoStatus(msg));
+  return true;
+}
+
+bool domoticzScene(uint16_t idx, const char *msg)
+{
+  #ifdef TRACE
+    Serial.println(F("TRACE: in domoticzScene"));
+  #endif
+  if(!checkWifi()) return false;
+  char message[DOMO_PATHSIZE];
+  snprintf_P(message, sizeof(message), DOMO_URL_SCENE, idx, msg);
+  if(!domoticz->request(message, DOMO_SCENE, idx, domoticzSceneCallback, DEFAULT_SWITCH_RETRIES-1)) return false;
+  for(uint i=0;i<NUMZONAS;i++) {
+    if(grupoPendientes & ZONABIT(i)) setShadowDeseado(Boton[bID_bIndex(ZONAS[i])].idx, estadoStatus(msg));
+  }
+  #ifdef DEBUG
+    Serial.printf("DOMOTICZSCENE IDX: %d %s (zonas 0x%x) \n", idx, msg, grupoPendientes);
+  #endif
   return true;
 }
 
+void domoticzSceneCallback(S_DOMOREQ *req, int rc, JsonDocument &jsondoc)
+{
+  if (rc == DOMO_RETRY) {
+    Serial.printf("DOMOTICZSCENE IDX: %d fallo (intento %d, quedan %d)\n", req->idx, req->attempt, req->retries);
+    return;
+  }
+  //el grupo confirma la orden pero no que todas sus zonas esten apagadas: se consulta su estado
+  if (rc == DOMO_OK) queryGrupo(req->idx);
+  else {
+    Serial.printf("[ERROR] DOMOTICZSCENE IDX: %d fallo, se apagan las zonas una a una \n", req->idx);
+    stopZonas(grupoPendientes);
+  }
+}
+
+void domoticzSwitchCallback(S_DOMOREQ *req, int rc, JsonDocument &jsondoc)
+{
+  bool on = (strstr(req->path, "switchcmd=On") != NULL);
+  if (rc == DOMO_RETRY) {
+    bip(1);
+    Serial.printf("DOMOTICZSWITH IDX: %d fallo en %s (intento %d, quedan %d)\n", req->idx, on ? "On" : "Off", req->attempt, req->retries);
+    return;
+  }
+  if (!on) stopConfirmado(req->idx);
+  if (rc == DOMO_OK) {
+    setShadowReportado(req->idx, on ? ZONA_ON : ZONA_OFF, SH_SWITCH);
+    return;
+  }
+  Serial.printf("DOMOTICZSWITH IDX: %d fallo en %s\n", req->idx, on ? "On" : "Off");
+  //el motor no conoce el estado de la maquina: el fallo se anota y lo trata procesaEstados
+  uint8_t fase = (rc == DOMO_ERRX) ? (on ? E4 : E5) : E2;
+  setShadowFallo(req->idx, on ? ZONA_ON : ZONA_OFF, fase);
+}
+
+void procesaFallosSwitch()
+{
+  for(uint i=0;i<NUMZONAS;i++) {
+    if(shadow[i].fallo == CERO) continue;
+    uint8_t fase = shadow[i].fallo;
+    bool on = (shadow[i].falloOrden == ZONA_ON);
+    shadow[i].fallo = CERO;
+    S_BOTON *b = &Boton[bID_bIndex(ZONAS[i])];
+    Serial.printf("[ERROR] procesaFallosSwitch: %s no ha aceptado el %s (Err%d) \n", b->desc, on ? "On" : "Off", fase);
+    if (on && multi.cerrando && b == ultimoBoton) {
+      Serial.printf("[ERROR] MULTIRRIEGO %s interrumpido: %s no abre, se cierra %s \n", multi.desc, b->desc, multi.cerrando->desc);
+      cierraAnterior();
+    }
+    if (!errorOFF && Estado.estado != ERROR) statusError(fase, (fase == E5) ? 5 : 3);
+    //un Off fallido deja la zona regando: se senaliza igual que en stopRiego
+    if (!on && !errorOFF) {
+      errorOFF = true;
+      ledAnim(LEDBIT(LEDR), 200, 200, 0, ANIM_ON);
+      ledAnim(LEDBIT(b->led), 400, 400, 0, ANIM_ZONA);
+    }
+  }
+}
+
 
 void flagVerificaciones() 
 {
   flagV = ON; 
+  tFlagV = millis();
 }
 
 void Verificaciones() 
@@ -1333,6 +1937,7 @@ void Verificaciones()
       initFactorRiegos();
     }
     if (!timeOK && connected) initClock();    
+    if (Estado.estado == STANDBY && connected && !falloAP) refreshFactors();
   }
   flagV = OFF;
 }
@@ -1350,36 +1955,19 @@ void statusError(uint8_t errorID, int n)
 }
 
 
-void parpadeoLedON()
-{
-  byte estado = ledStatusId(LEDR);
-  led(LEDR,!estado);
-}
-void parpadeoLedZona()
-{
-  byte estado = ledStatusId(ledID);
-  led(ledID,!estado);
-}
-
-void parpadeoLedConf()
-{
-  byte estado = ledStatusId(LEDR);
-  led(LEDR,!estado);
-  estado = ledStatusId(LEDG);
-  led(LEDG,!estado);
-}
-
 void ledConf(int estado)
 {
   if(estado == ON) 
   {
     led(LEDB,OFF);
     led(LEDG,OFF);
-    tic_parpadeoLedConf.attach(0.7,parpadeoLedConf);
+    //LEDR y LEDG alternados
+    ledAnim(LEDBIT(LEDR), 700, 700, 0, ANIM_CONF);
+    ledAnim(LEDBIT(LEDG), 700, 700, 0, ANIM_CONF, 700);
   }
   else 
   {
-    tic_parpadeoLedConf.detach();   
+    ledAnimStop(ANIM_CONF);
     led(LEDR,ON);                  
     NONETWORK ? led(LEDB,ON) : led(LEDB,OFF);
     checkWifi();
@@ -1448,9 +2036,9 @@ bool setupConfig(const char *p_filename, Config_parm &cfg)
   void printMulti()
   {
       Serial.println(F("TRACE: in printMulti"));
-      Serial.printf("MULTI Boton_id x%x: size=%d (%s)\n", *multi.id, *multi.size, multi.desc);
+      Serial.printf("MULTI Boton_id x%lx: size=%d (%s)\n", (unsigned long)*multi.id, *multi.size, multi.desc);
       for(int j = 0; j < *multi.size; j++) {
-        Serial.printf("  Zona  id: x%x \n", multi.serie[j]);
+        Serial.printf("  Zona  id: x%lx \n", (unsigned long)multi.serie[j]);
       }
     Serial.println();
   }
@@ -1460,7 +2048,7 @@ bool setupConfig(const char *p_filename, Config_parm &cfg)
     if (Serial.available() > 0) {
       String inputSerial = Serial.readString();
       int inputNumber = inputSerial.toInt();
-      if ((!inputNumber || inputNumber>6) && inputNumber != 9) {
+      if (!inputNumber || inputNumber>13) {
           Serial.println(F("Teclee: "));
           Serial.println(F("   1 - simular error NTP"));
           Serial.println(F("   2 - simular error apagar riego"));
@@ -1468,7 +2056,13 @@ bool setupConfig(const char *p_filename, Config_parm &cfg)
           Serial.println(F("   4 - simular EV no esta ON en Domoticz"));
           Serial.println(F("   5 - simular EV no esta OFF en Domoticz"));
           Serial.println(F("   6 - simular error al salir del PAUSE"));
+          Serial.println(F("   7 - estado de la sombra local Domoticz"));
+          Serial.println(F("   8 - estadisticas de peticiones a Domoticz"));
           Serial.println(F("   9 - anular simulacion errores"));
+          Serial.println(F("  10 - benchmark registros de desplazamiento (LEDs y botones)"));
+          Serial.println(F("  11 - escrituras por segundo de la cadena de LEDs"));
+          Serial.println(F("  12 - benchmark busqueda de botones y zonas"));
+          Serial.println(F("  13 - comprobar eventos de todos los botones"));
       }
       switch (inputNumber) {
             case 1:
@@ -1495,10 +2089,29 @@ bool setupConfig(const char *p_filename, Config_parm &cfg)
                 Serial.println(F("recibido:   6 - simular error al salir del PAUSE"));
                 simular.ErrorPause = true;
                 break;
+            case 7:
+                shadowInfo();
+                break;
+            case 8:
+                domoticz->printStats(Serial);
+                break;
             case 9:
                 Serial.println(F("recibido:   9 - anular simulacion errores"));
                 timeOK = true;                         
                 simular.all_simFlags = false;
+                break;
+            case 10:
+                benchShiftRegisters();
+                break;
+            case 11:
+                ledStatsInfo();
+                break;
+            case 12:
+                benchLookups();
+                break;
+            case 13:
+                checkInputEvents();
+                break;
       }
     }
   }
@@ -0,0 +1,158 @@
+/**
+ * @file DomoMqtt.cpp
+ * @brief Implementation of the MQTT transport for Domoticz.
+ *
+ * The connection with the broker is attempted at most every MQTT_RECONNECT ms,
+ * with a connect timeout of MQTT_CONNECTTIMEOUT ms and a wait for CONNACK of
+ * MQTT_SOCKETTIMEOUT s (PubSubClient waits 15 s by default), so a missing
+ * broker costs loop() a short stall from time to time and nothing else. Messages of
+ * domoticz/out are filtered down to idx, nvalue and dtype; only switches are
+ * passed on, and each one clears the published command of its idx when it
+ * carries the ordered state.
+ *
+ * @note This file is part of the ControlRiego-2.5 project.
+ *
+ * @version 2.5
+ * @date 2024
+ */
+#include "DomoMqtt.h"
+#include "Control.h"
+
+DomoMqtt *DomoMqtt::_instance = NULL;
+
+DomoMqtt::DomoMqtt(const char *host, const char *port, mqttCallback callback, mqttCallback lostCallback) : _mqtt(_client)
+{
+  _host = host;
+  _port = atoi(port);
+  _callback = callback;
+  _lostCallback = lostCallback;
+  memset(_pending, 0, sizeof(_pending));
+  _lastAttempt = 0;
+  _up = false;
+  _received = 0;
+  _published = 0;
+  _lost = 0;
+  _instance = this;
+  _mqtt.setServer(_host, _port);
+  _mqtt.setBufferSize(MQTT_BUFFERSIZE);
+  //tambien limita lo que loop() espera el resto de un mensaje a medio llegar
+  _mqtt.setSocketTimeout(MQTT_SOCKETTIMEOUT);
+  _mqtt.setCallback(onMessage);
+}
+
+void DomoMqtt::service()
+{
+  if (_mqtt.connected()) {
+    _mqtt.loop();
+    expire(false);
+    return;
+  }
+  if (_up) {
+    _up = false;
+    Serial.println(F("[ERROR] MQTT: conexion con el broker perdida"));
+    //sin conexion ya no puede llegar ningun eco
+    expire(true);
+  }
+  if (WiFi.status() != WL_CONNECTED) return;
+  if (_lastAttempt && millis() - _lastAttempt < MQTT_RECONNECT) return;
+  reconnect();
+}
+
+void DomoMqtt::reconnect()
+{
+  char clientId[24];
+  _lastAttempt = millis();
+  sprintf(clientId, "ControlRiego-%06x", ESP.getChipId());
+  _client.setTimeout(MQTT_CONNECTTIMEOUT);
+  if (!_mqtt.connect(clientId) || !_mqtt.subscribe(MQTT_TOPIC_OUT)) {
+    Serial.printf("[ERROR] MQTT: no se puede conectar con %s:%d (rc=%d) \n", _host, _port, _mqtt.state());
+    return;
+  }
+  _up = true;
+  Serial.printf("MQTT: conectado a %s:%d, suscrito a %s \n", _host, _port, MQTT_TOPIC_OUT);
+}
+
+void DomoMqtt::expire(bool all)
+{
+  for (uint8_t i = 0; i < MQTT_PENDING; i++) {
+    S_MQTTCMD *cmd = &_pending[i];
+    if (!cmd->idx || (!all && millis() - cmd->sent < MQTT_ACKTIMEOUT)) continue;
+    S_MQTTCMD lost = *cmd;
+    cmd->idx = 0;
+    _lost++;
+    Serial.printf("[ERROR] MQTT: sin eco de %s idx %d \n", lost.on ? "On" : "Off", lost.idx);
+    if (_lostCallback) _lostCallback(lost.idx, lost.on);
+  }
+}
+
+void DomoMqtt::onMessage(char *topic, uint8_t *payload, unsigned int length)
+{
+  StaticJsonDocument<64> filter;
+  filter["idx"] = true;
+  filter["nvalue"] = true;
+  filter["dtype"] = true;
+  StaticJsonDocument<128> doc;
+  DeserializationError error = deserializeJson(doc, (const char *)payload, length, DeserializationOption::Filter(filter));
+  if (error) {
+    Serial.print(F("[ERROR] MQTT: deserializeJson() failed: "));
+    Serial.println(error.f_str());
+    return;
+  }
+  _instance->_received++;
+  //solo interesan los interruptores (las electrovalvulas)
+  if (strcmp(doc["dtype"] | "", "Light/Switch") != 0) return;
+  uint16_t idx = doc["idx"] | 0;
+  if (idx == 0) return;
+  bool on = (doc["nvalue"] | 0) != 0;
+  #ifdef EXTRADEBUG
+    Serial.printf("MQTT: recibido idx %d nvalue %d \n", idx, doc["nvalue"] | 0);
+  #endif
+  //eco de una orden publicada: ya la ha ejecutado Domoticz
+  for (uint8_t i = 0; i < MQTT_PENDING; i++) {
+    if (_instance->_pending[i].idx == idx && _instance->_pending[i].on == on) _instance->_pending[i].idx = 0;
+  }
+  if (_instance->_callback) _instance->_callback(idx, on);
+}
+
+bool DomoMqtt::connected()
+{
+  return _up;
+}
+
+bool DomoMqtt::switchLight(uint16_t idx, const char *cmd)
+{
+  if (!_up) return false;
+  //una orden nueva para el idx sustituye a la que aun espera su eco
+  S_MQTTCMD *pending = NULL;
+  for (uint8_t i = 0; i < MQTT_PENDING; i++) {
+    if (_pending[i].idx == idx || (!pending && !_pending[i].idx)) pending = &_pending[i];
+    if (_pending[i].idx == idx) break;
+  }
+  if (!pending) return false;
+  char message[80];
+  sprintf(message, "{\"command\":\"switchlight\",\"idx\":%d,\"switchcmd\":\"%s\"}", idx, cmd);
+  if (!_mqtt.publish(MQTT_TOPIC_IN, message)) return false;
+  pending->idx = idx;
+  pending->on = (strcmp(cmd, "On") == 0);
+  pending->sent = millis();
+  _published++;
+  #ifdef DEBUG
+    Serial.printf("MQTT: %s %s \n", MQTT_TOPIC_IN, message);
+  #endif
+  return true;
+}
+
+uint32_t DomoMqtt::received()
+{
+  return _received;
+}
+
+uint32_t DomoMqtt::published()
+{
+  return _published;
+}
+
+uint32_t DomoMqtt::lost()
+{
+  return _lost;
+}
@@ -0,0 +1,754 @@
+/**
+ * @file Domoticz.cpp
+ * @brief Implementation of the asynchronous Domoticz request engine.
+ *
+ * Each request goes through the states CONNECT -> HEADERS -> BODY and every
+ * call to service() does at most one step per slot, reading no more than
+ * DOMO_SLICEBYTES bytes and only those already received, so the time spent per
+ * loop() iteration is bounded regardless of how slow Domoticz answers. A
+ * request that does not finish in DOMO_TIMEOUT ms is completed with DOMO_ERR2.
+ *
+ * A fresh connection (the blocking connect()) is attempted by one slot per
+ * service() call at most. When it fails the request ends with DOMO_ERR2 and
+ * the next attempt waits for the same backoff as the retries, doubling with
+ * every consecutive failure; meanwhile the other slots stay in CONNECT until
+ * their own DOMO_TIMEOUT. So a service() call blocks at most
+ * DOMO_CONNECTTIMEOUT ms, in connect(), and only when a fresh connection is
+ * needed.
+ *
+ * A free slot takes the first queued request whose time has come and whose
+ * idx is not already in progress in another slot, so commands for different
+ * zones travel in parallel while those for the same zone keep their order.
+ *
+ * The socket of each slot is kept open (HTTP/1.1 keep-alive) as long as the
+ * server sends a Content-Length and does not ask to close it. If a reused
+ * connection turns out to be closed before any byte of the answer arrives,
+ * the request is sent again once over a fresh connection.
+ *
+ * The body is scanned a byte at a time as the slices read it (scan), keeping
+ * track only of the nesting, the keys and the strings of the JSON. The values
+ * of the fields the controller uses are copied to the buffer of the slot as a
+ * compact JSON (status and ActTime of the response, idx, Name, Description
+ * and Status of the first result), and the rest is dropped as it goes by. When
+ * the response object closes, that buffer is deserialized into the document of
+ * the engine. In a device list the buffer holds a single result: it is
+ * deserialized and passed to the callback as soon as the result closes, and
+ * then reused for the next one. A list without results is an empty list.
+ *
+ * A request answered with status ERR that still has retries goes back to the
+ * queue with a notBefore of DOMO_RETRYBASE * 2^attempt ms (up to DOMO_RETRYMAX)
+ * plus a random jitter of up to half that time.
+ *
+ * Every attempt is accounted when it finishes (finish -> record): its result
+ * and the ms spent in each phase it reached, in buckets bounded by
+ * bucketLimits (the last one open).
+ *
+ * @note This file is part of the ControlRiego-2.5 project.
+ *
+ * @version 2.5
+ * @date 2024
+ */
+#include "Domoticz.h"
+#include "Control.h"
+
+//Estados de la peticion en curso
+enum _domoEstados {
+  DOMO_IDLE     ,
+  DOMO_CONNECT  ,
+  DOMO_HEADERS  ,
+  DOMO_BODY     ,
+};
+
+//Estados de la lectura del cuerpo
+enum _domoScan {
+  SCAN_NADA     ,   // entre elementos del JSON
+  SCAN_CLAVE    ,   // dentro de una clave
+  SCAN_CADENA   ,   // dentro de una cadena
+  SCAN_ESCALAR  ,   // dentro de un numero, true, false o null que se copia
+};
+#define SCAN_SIGUE    -1    // resultado de scan() y readBody(): el cuerpo aun no esta completo
+
+//campos que se conservan: del objeto de la respuesta y de cada elemento de result
+enum _domoCampos {
+  CAMPO_STATUS      ,
+  CAMPO_ACTTIME     ,
+  CAMPO_RESULT      ,
+  CAMPO_IDX         ,   // primero de los campos de un elemento
+  CAMPO_NAME        ,
+  CAMPO_DESCRIPTION ,
+  CAMPO_ITEMSTATUS  ,
+  DOMO_CAMPOS       ,
+};
+
+//limite superior (ms) de cada intervalo de los histogramas, el ultimo es abierto
+static const uint16_t bucketLimits[DOMO_BUCKETS - 1] = {10, 25, 50, 100, 250, 500, 1000};
+static const char *nTipos[DOMO_TIPOS] = {"factor", "status", "switch", "factors", "scene", "scenes"};
+static const char *nFases[DOMO_T_FASES] = {"connect", "1st byte", "body", "parse"};
+static const char *nCampos[DOMO_CAMPOS] = {"status", "ActTime", "result", "idx", "Name", "Description", "Status"};
+static_assert(DOMO_LINESIZE <= 256, "S_DOMOSLOT.lineLen es de 8 bits");
+static_assert(DOMO_DEPTH <= 16, "S_DOMOSCAN.objetos es de 16 bits");
+static_assert(DOMO_VALUESIZE >= 6 && DOMO_VALUESIZE < 256, "S_DOMOSCAN.valueLen es de 8 bits y un escape ocupa hasta 6");
+
+//espera exponencial (DOMO_RETRYBASE * 2^intento, hasta DOMO_RETRYMAX) con jitter de hasta la mitad
+static unsigned long esperaBackoff(uint8_t intento)
+{
+  unsigned long espera = (intento < 5) ? ((unsigned long)DOMO_RETRYBASE << intento) : DOMO_RETRYMAX;
+  if (espera > DOMO_RETRYMAX) espera = DOMO_RETRYMAX;
+  return espera + random(espera / 2 + 1);
+}
+
+//copia un caracter al JSON filtrado
+static void scanPut(S_DOMOSCAN *sc, char c)
+{
+  if (sc->outLen < DOMO_BODYSIZE - 1) sc->out[sc->outLen++] = c;
+  else sc->lleno = true;
+}
+
+//abre en el JSON filtrado el campo en curso ("clave": tras una coma si no es el primero)
+static void scanKey(S_DOMOSCAN *sc)
+{
+  char ultimo = sc->outLen ? sc->out[sc->outLen - 1] : '{';
+  if (ultimo != '{' && ultimo != '[') scanPut(sc, ',');
+  scanPut(sc, '"');
+  for (const char *k = nCampos[sc->campo]; *k; k++) scanPut(sc, *k);
+  scanPut(sc, '"');
+  scanPut(sc, ':');
+  sc->valuePos = sc->outLen;
+  sc->valueLen = 0;
+}
+
+//copia un caracter del valor en curso, que se corta en DOMO_VALUESIZE caracteres
+static void scanValue(S_DOMOSCAN *sc, char c)
+{
+  if (sc->valueLen >= DOMO_VALUESIZE) return;
+  scanPut(sc, c);
+  sc->valueLen++;
+}
+
+//campo que se conserva con la ultima clave leida, segun donde esta (-1 si no se conserva)
+static int8_t scanCampo(S_DOMOSCAN *sc)
+{
+  uint8_t desde, hasta;
+  if (sc->depth == 1) {
+    desde = CAMPO_STATUS;
+    hasta = CAMPO_IDX;
+  }
+  else if (sc->depth == 3 && sc->enItem) {
+    desde = CAMPO_IDX;
+    hasta = DOMO_CAMPOS;
+  }
+  else return -1;
+  for (uint8_t i = desde; i < hasta; i++) {
+    if (strcmp(sc->key, nCampos[i]) == 0) return i;
+  }
+  return -1;
+}
+
+Domoticz::Domoticz(const char *host, const char *port)
+{
+  _head = 0;
+  _count = 0;
+  for (uint8_t i = 0; i < DOMO_SLOTS; i++) _slots[i].state = DOMO_IDLE;
+  _syncDone = false;
+  _connects = 0;
+  _reuses = 0;
+  _connectSlice = false;
+  resetStats();
+  //setServer() recorre los slots: tienen que estar ya inicializados
+  setServer(host, port);
+}
+
+void Domoticz::setServer(const char *host, const char *port)
+{
+  strlcpy(_host, host, sizeof(_host));
+  _port = atoi(port);
+  if (!_ip.fromString(_host)) _ip = IPAddress();
+  snprintf_P(_headers, sizeof(_headers), PSTR("Host: %s:%d\r\nConnection: keep-alive\r\n\r\n"), _host, _port);
+  _connectFails = 0;
+  _connectNotBefore = millis();
+  //las conexiones abiertas pueden ser con el servidor anterior
+  for (uint8_t i = 0; i < DOMO_SLOTS; i++) {
+    if (_slots[i].state == DOMO_IDLE) _slots[i].client.stop();
+  }
+}
+
+bool Domoticz::request(const char *path, uint8_t tipo, uint16_t idx, domoCallback callback, uint8_t retries)
+{
+  //una orden nueva para el mismo idx sustituye a la que aun espera en cola
+  if (tipo == DOMO_SWITCH && cancel(idx)) {
+    #ifdef DEBUG
+      Serial.printf("DOMOTICZ: sustituida orden pendiente idx %d \n", idx);
+    #endif
+  }
+  if (_count == DOMO_QUEUE) {
+    Serial.printf("[ERROR] Domoticz: cola llena, descartada peticion idx %d \n", idx);
+    return false;
+  }
+  S_DOMOREQ *req = &_queue[(_head + _count) % DOMO_QUEUE];
+  strlcpy(req->path, path, sizeof(req->path));
+  req->tipo = tipo;
+  req->idx = idx;
+  req->sync = false;
+  req->retries = retries;
+  req->attempt = 0;
+  req->notBefore = millis();
+  req->callback = callback;
+  _count++;
+  return true;
+}
+
+int Domoticz::get(const char *path, uint8_t tipo, uint16_t idx, domoCallback itemCallback)
+{
+  #ifdef TRACE
+    Serial.println(F("TRACE: in Domoticz::get"));
+  #endif
+  _syncDone = false;
+  while (!request(path, tipo, idx, itemCallback)) {
+    service();
+    yield();
+  }
+  _queue[(_head + _count - 1) % DOMO_QUEUE].sync = true;
+  while (!_syncDone) {
+    service();
+    yield();
+  }
+  _syncDone = false;
+  return _syncRc;
+}
+
+JsonDocument &Domoticz::doc()
+{
+  return _doc;
+}
+
+int Domoticz::pending()
+{
+  int n = _count;
+  for (uint8_t i = 0; i < DOMO_SLOTS; i++) if (_slots[i].state != DOMO_IDLE) n++;
+  return n;
+}
+
+bool Domoticz::retrying(uint16_t idx)
+{
+  for (uint8_t i = 0; i < _count; i++) {
+    S_DOMOREQ *req = &_queue[(_head + i) % DOMO_QUEUE];
+    if (req->idx == idx && req->attempt) return true;
+  }
+  for (uint8_t i = 0; i < DOMO_SLOTS; i++) {
+    if (_slots[i].state != DOMO_IDLE && _slots[i].req.idx == idx && _slots[i].req.attempt) return true;
+  }
+  return false;
+}
+
+bool Domoticz::inFlight(uint16_t idx)
+{
+  for (uint8_t i = 0; i < _count; i++) {
+    if (_queue[(_head + i) % DOMO_QUEUE].idx == idx) return true;
+  }
+  return busy(idx);
+}
+
+int Domoticz::cancel(uint16_t idx)
+{
+  int n = 0;
+  uint8_t i = 0;
+  while (i < _count) {
+    S_DOMOREQ *req = &_queue[(_head + i) % DOMO_QUEUE];
+    if (req->tipo == DOMO_SWITCH && req->idx == idx) {
+      remove(i);
+      n++;
+    }
+    else i++;
+  }
+  return n;
+}
+
+bool Domoticz::flush(unsigned long timeout)
+{
+  unsigned long start = millis();
+  while (pending() && millis() - start < timeout) {
+    service();
+    yield();
+  }
+  return (pending() == 0);
+}
+
+bool Domoticz::room(unsigned long timeout)
+{
+  unsigned long start = millis();
+  while (_count == DOMO_QUEUE && millis() - start < timeout) {
+    service();
+    yield();
+  }
+  return (_count < DOMO_QUEUE);
+}
+
+uint32_t Domoticz::connects()
+{
+  return _connects;
+}
+
+uint32_t Domoticz::reuses()
+{
+  return _reuses;
+}
+
+void Domoticz::service()
+{
+  _connectSlice = false;
+  for (uint8_t i = 0; i < DOMO_SLOTS; i++) {
+    serviceSlot(&_slots[i]);
+    //el documento de una peticion sincrona no debe pisarse antes de que get() lo devuelva
+    if (_syncDone) return;
+  }
+}
+
+void Domoticz::serviceSlot(S_DOMOSLOT *s)
+{
+  switch (s->state) {
+    case DOMO_IDLE:
+      if (!schedule(s)) return;
+      s->start = millis();
+      //nada de la peticion anterior puede llegar a las estadisticas de esta
+      s->fases = 0;
+      s->tSent = s->tFirst = s->tBody = s->tParsed = s->start;
+      s->httpCode = 0;
+      s->state = DOMO_CONNECT;
+      return;
+    case DOMO_CONNECT:
+      s->reused = s->client.connected();
+      if (s->reused) _reuses++;
+      else {
+        //connect() bloquea: una conexion nueva por service() y ninguna durante la espera tras un fallo
+        if (_connectSlice || (long)(millis() - _connectNotBefore) < 0) break;
+        _connectSlice = true;
+        s->client.setTimeout(DOMO_CONNECTTIMEOUT);
+        //con la IP ya interpretada se evita resolverla en cada conexion
+        if (!(_ip.isSet() ? s->client.connect(_ip, _port) : s->client.connect(_host, _port))) {
+          _connectNotBefore = millis() + esperaBackoff(_connectFails);
+          if (_connectFails < 0xFF) _connectFails++;
+          finish(s, DOMO_ERR2, "conexion rechazada");
+          return;
+        }
+        _connectFails = 0;
+        s->client.setNoDelay(true);
+        _connects++;
+      }
+      #ifdef DEBUG
+        Serial.printf("DOMOTICZ[%d]: http://%s:%d%s (conexiones: %d reutilizadas: %d)\n", (int)(s - _slots), _host, _port, s->req.path, _connects, _reuses);
+      #endif
+      sendRequest(s);
+      s->tSent = millis();
+      s->fases |= (1 << DOMO_T_CONNECT);
+      s->contentLength = -1;
+      s->keepAlive = true;
+      s->received = 0;
+      s->lineLen = 0;
+      s->state = DOMO_HEADERS;
+      return;
+    case DOMO_HEADERS:
+      readHeaders(s);
+      break;
+    case DOMO_BODY: {
+      int rc = readBody(s);
+      if (rc != SCAN_SIGUE) {
+        s->tParsed = millis();
+        s->fases |= (1 << DOMO_T_PARSE);
+        finish(s, rc, NULL);
+        return;
+      }
+      if (!s->client.available() && !s->client.connected()) finish(s, DOMO_ERR2, "conexion cerrada");
+      break;
+    }
+  }
+  if (s->state != DOMO_IDLE && millis() - s->start > DOMO_TIMEOUT) finish(s, DOMO_ERR2, "timeout");
+}
+
+void Domoticz::sendRequest(S_DOMOSLOT *s)
+{
+  //toda la peticion en un unico write (un solo segmento TCP)
+  char buf[DOMO_PATHSIZE + DOMO_HEADERSIZE + 16];
+  int n = snprintf_P(buf, sizeof(buf), PSTR("GET %s HTTP/1.1\r\n%s"), s->req.path, _headers);
+  s->client.write((const uint8_t *)buf, min(n, (int)sizeof(buf) - 1));
+}
+
+void Domoticz::readHeaders(S_DOMOSLOT *s)
+{
+  int n = 0;
+  while (s->client.available() && n < DOMO_SLICEBYTES) {
+    char c = s->client.read();
+    if (!(s->fases & (1 << DOMO_T_FIRSTBYTE))) {
+      s->tFirst = millis();
+      s->fases |= (1 << DOMO_T_FIRSTBYTE);
+    }
+    n++;
+    s->received++;
+    if (c == '\r') continue;
+    if (c != '\n') {
+      //las lineas mas largas se truncan: solo interesan sus primeros caracteres
+      if (s->lineLen < DOMO_LINESIZE - 1) s->line[s->lineLen++] = c;
+      continue;
+    }
+    s->line[s->lineLen] = '\0';
+    if (s->httpCode == 0) {
+      //linea de estado: HTTP/1.1 200 OK
+      const char *pos = strchr(s->line, ' ');
+      s->httpCode = (pos == NULL) ? -1 : atoi(pos + 1);
+    }
+    else if (s->lineLen == 0) {
+      s->tBody = millis();
+      s->fases |= (1 << DOMO_T_BODY);
+      s->state = DOMO_BODY;
+      s->bodyLeft = s->contentLength;
+      memset(&s->scan, 0, sizeof(s->scan));
+      s->scan.campo = -1;
+      if (s->httpCode != 200) finish(s, DOMO_ERR2, "HTTP");
+      return;
+    }
+    else if (strncasecmp(s->line, "content-length:", 15) == 0) s->contentLength = atol(s->line + 15);
+    else if (strncasecmp(s->line, "connection:", 11) == 0) {
+      const char *valor = s->line + 11;
+      while (*valor == ' ') valor++;
+      if (strncasecmp(valor, "close", 5) == 0) s->keepAlive = false;
+    }
+    s->lineLen = 0;
+  }
+  if (!n && !s->client.connected()) {
+    if (!reconnect(s)) finish(s, DOMO_ERR2, "conexion cerrada");
+  }
+}
+
+bool Domoticz::reconnect(S_DOMOSLOT *s)
+{
+  //el servidor cerro la conexion reutilizada antes de responder: un reintento con conexion nueva
+  if (!s->reused || s->received) return false;
+  #ifdef DEBUG
+    Serial.println(F("DOMOTICZ: conexion cerrada por el servidor, reconectando"));
+  #endif
+  s->client.stop();
+  s->state = DOMO_CONNECT;
+  return true;
+}
+
+bool Domoticz::schedule(S_DOMOSLOT *s)
+{
+  //primera peticion de la cola que ya puede enviarse y cuyo idx no esta en curso en otro slot
+  for (uint8_t i = 0; i < _count; i++) {
+    S_DOMOREQ *req = &_queue[(_head + i) % DOMO_QUEUE];
+    if ((long)(millis() - req->notBefore) < 0) continue;
+    if (req->idx && busy(req->idx)) continue;
+    s->req = *req;
+    remove(i);
+    return true;
+  }
+  return false;
+}
+
+bool Domoticz::busy(uint16_t idx)
+{
+  for (uint8_t i = 0; i < DOMO_SLOTS; i++) {
+    if (_slots[i].state != DOMO_IDLE && _slots[i].req.idx == idx) return true;
+  }
+  return false;
+}
+
+void Domoticz::remove(uint8_t pos)
+{
+  for (uint8_t j = pos; j + 1 < _count; j++) _queue[(_head + j) % DOMO_QUEUE] = _queue[(_head + j + 1) % DOMO_QUEUE];
+  _count--;
+}
+
+bool Domoticz::superseded(S_DOMOREQ *req)
+{
+  if (req->tipo != DOMO_SWITCH) return false;
+  for (uint8_t i = 0; i < _count; i++) {
+    S_DOMOREQ *next = &_queue[(_head + i) % DOMO_QUEUE];
+    if (next->tipo == DOMO_SWITCH && next->idx == req->idx) return true;
+  }
+  return false;
+}
+
+int Domoticz::readBody(S_DOMOSLOT *s)
+{
+  int n = 0;
+  int rc = SCAN_SIGUE;
+  while (rc == SCAN_SIGUE && s->bodyLeft != 0 && n < DOMO_SLICEBYTES && s->client.available()) {
+    char c = s->client.read();
+    n++;
+    s->received++;
+    if (s->bodyLeft > 0) s->bodyLeft--;
+    rc = scan(s, c);
+  }
+  if (rc == SCAN_SIGUE) {
+    if (s->bodyLeft != 0) return SCAN_SIGUE;
+    Serial.println(F("[ERROR] Domoticz: respuesta incompleta"));
+    return DOMO_ERRJSON;
+  }
+  if (rc == DOMO_OK) {
+    if (s->req.tipo == DOMO_FACTORS || s->req.tipo == DOMO_SCENES) _doc.clear();
+    else rc = parseBody(s);
+    if (rc == DOMO_OK && s->scan.statusErr) rc = DOMO_ERRX;
+  }
+  //descarta el resto del cuerpo (fin de linea) para poder reutilizar la conexion
+  while (s->bodyLeft > 0 && s->client.available()) {
+    s->client.read();
+    s->bodyLeft--;
+  }
+  if (s->bodyLeft != 0) s->keepAlive = false;
+  return rc;
+}
+
+int Domoticz::scan(S_DOMOSLOT *s, char c)
+{
+  S_DOMOSCAN *sc = &s->scan;
+  bool lista = (s->req.tipo == DOMO_FACTORS || s->req.tipo == DOMO_SCENES);
+  bool objeto = sc->depth && (sc->objetos & (1 << (sc->depth - 1)));
+  switch (sc->modo) {
+    case SCAN_CLAVE:
+    case SCAN_CADENA:
+      if (sc->escape) sc->escape = false;
+      else if (c == '\\') {
+        sc->escape = true;
+        //un escape se copia entero o no se copia (\uXXXX son 6 caracteres)
+        if (sc->campo >= 0 && sc->valueLen + 6 > DOMO_VALUESIZE) sc->valueLen = DOMO_VALUESIZE;
+      }
+      else if (c == '"') {
+        if (sc->modo == SCAN_CLAVE) sc->key[(sc->keyLen < sizeof(sc->key)) ? sc->keyLen : 0] = '\0';
+        else if (sc->campo >= 0) {
+          scanPut(sc, '"');
+          if (sc->campo == CAMPO_STATUS) sc->statusErr = (sc->valueLen == 3 && strncmp(sc->out + sc->valuePos, "ERR", 3) == 0);
+          sc->campo = -1;
+        }
+        sc->modo = SCAN_NADA;
+        return SCAN_SIGUE;
+      }
+      if (sc->modo == SCAN_CLAVE) {
+        //las claves mas largas que key no son de ningun campo que se conserve
+        if (sc->keyLen < sizeof(sc->key)) sc->key[sc->keyLen++] = c;
+      }
+      else if (sc->campo >= 0) scanValue(sc, c);
+      return SCAN_SIGUE;
+    case SCAN_ESCALAR:
+      if (c != ',' && c != '}' && c != ']' && c != ' ' && c != '\t' && c != '\r' && c != '\n') {
+        scanValue(sc, c);
+        return SCAN_SIGUE;
+      }
+      //el delimitador cierra el valor y se trata abajo
+      sc->campo = -1;
+      sc->modo = SCAN_NADA;
+      break;
+  }
+  switch (c) {
+    case '"':
+      if (objeto && sc->esperaClave) {
+        sc->modo = SCAN_CLAVE;
+        sc->keyLen = 0;
+        return SCAN_SIGUE;
+      }
+      sc->modo = SCAN_CADENA;
+      if (sc->campo == CAMPO_RESULT) sc->campo = -1;
+      if (sc->campo >= 0) {
+        scanKey(sc);
+        scanPut(sc, '"');
+        sc->valuePos = sc->outLen;
+      }
+      return SCAN_SIGUE;
+    case ':':
+      sc->esperaClave = false;
+      sc->campo = scanCampo(sc);
+      return SCAN_SIGUE;
+    case ',':
+      sc->esperaClave = objeto;
+      return SCAN_SIGUE;
+    case '{':
+    case '[':
+      if (sc->depth == DOMO_DEPTH) {
+        Serial.println(F("[ERROR] Domoticz: respuesta con demasiados niveles"));
+        return DOMO_ERRJSON;
+      }
+      if (sc->depth == 0 && !lista) scanPut(sc, '{');
+      else if (c == '[' && sc->depth == 1 && sc->campo == CAMPO_RESULT) {
+        sc->enResult = true;
+        if (!lista) {
+          scanKey(sc);
+          scanPut(sc, '[');
+        }
+      }
+      else if (c == '{' && sc->depth == 2 && sc->enResult) {
+        //en una lista cada elemento se copia en out desde el principio; si no, solo el primero
+        if (lista) {
+          sc->outLen = 0;
+          sc->lleno = false;
+        }
+        sc->enItem = lista || !sc->items;
+        sc->items = true;
+        if (sc->enItem) scanPut(sc, '{');
+      }
+      sc->campo = -1;
+      if (c == '{') sc->objetos |= (1 << sc->depth);
+      else sc->objetos &= ~(1 << sc->depth);
+      sc->depth++;
+      sc->esperaClave = (c == '{');
+      return SCAN_SIGUE;
+    case '}':
+    case ']':
+      if (sc->depth == 0) return DOMO_ERRJSON;
+      sc->depth--;
+      sc->esperaClave = false;
+      if (sc->depth == 2 && sc->enItem) {
+        sc->enItem = false;
+        scanPut(sc, '}');
+        if (lista) {
+          int rc = parseBody(s);
+          if (rc != DOMO_OK) return rc;
+          if (s->req.callback) s->req.callback(&s->req, DOMO_ITEM, _doc);
+          sc->outLen = 0;
+        }
+      }
+      else if (sc->depth == 1 && sc->enResult) {
+        sc->enResult = false;
+        if (!lista) scanPut(sc, ']');
+      }
+      else if (sc->depth == 0) {
+        if (!lista) scanPut(sc, '}');
+        return DOMO_OK;
+      }
+      return SCAN_SIGUE;
+    case ' ':
+    case '\t':
+    case '\r':
+    case '\n':
+      return SCAN_SIGUE;
+  }
+  //numero, true, false o null: solo se sigue si es de un campo que se conserva
+  if (sc->campo >= 0 && sc->campo != CAMPO_RESULT) {
+    scanKey(sc);
+    sc->modo = SCAN_ESCALAR;
+    scanValue(sc, c);
+  }
+  return SCAN_SIGUE;
+}
+
+int Domoticz::parseBody(S_DOMOSLOT *s)
+{
+  //JSON filtrado de out: la respuesta o un elemento de una lista
+  DeserializationError error = DeserializationError::NoMemory;
+  if (!s->scan.lleno) error = deserializeJson(_doc, (const char *)s->scan.out, s->scan.outLen);
+  if (error) {
+    Serial.print(F("[ERROR] Domoticz: deserializeJson() failed: "));
+    Serial.println(error.f_str());
+    return DOMO_ERRJSON;
+  }
+  #ifdef EXTRADEBUG
+    Serial.printf("DOMOTICZ: memoria usada por el jsondoc: (%d) \n", _doc.memoryUsage());
+  #endif
+  return DOMO_OK;
+}
+
+void Domoticz::finish(S_DOMOSLOT *s, int rc, const char *error)
+{
+  S_DOMOREQ req = s->req;
+  s->state = DOMO_IDLE;
+  record(s, rc);
+  if (rc == DOMO_ERR2 || rc == DOMO_ERRJSON || !s->keepAlive || s->contentLength < 0) s->client.stop();
+  if (error) {
+    Serial.printf("[ERROR] Domoticz: ERROR comunicando con Domoticz idx %d error: %s\n", req.idx, error);
+    _doc.clear();
+  }
+  if (rc == DOMO_ERRX) Serial.println(F("[ERROR] Domoticz: SE HA DEVUELTO ERROR"));
+  #ifdef EXTRADEBUG1
+    Serial.print(F("Domoticz RESPONSE: "));serializeJson(_doc, Serial);Serial.println();
+  #endif
+  if (rc != DOMO_OK && superseded(&req)) {
+    _stats[req.tipo].superseded++;
+    #ifdef DEBUG
+      Serial.printf("DOMOTICZ: descartado fallo de orden sustituida idx %d \n", req.idx);
+    #endif
+    return;
+  }
+  if (rc == DOMO_ERRX && req.retries && _count < DOMO_QUEUE) {
+    //reintento con espera exponencial y jitter, la peticion vuelve al final de la cola
+    unsigned long espera = esperaBackoff(req.attempt);
+    req.retries--;
+    req.attempt++;
+    _stats[req.tipo].retries++;
+    req.notBefore = millis() + espera;
+    S_DOMOREQ *retry = &_queue[(_head + _count) % DOMO_QUEUE];
+    *retry = req;
+    _count++;
+    #ifdef DEBUG
+      Serial.printf("DOMOTICZ: reintento %d idx %d dentro de %lu ms \n", req.attempt, req.idx, espera);
+    #endif
+    if (req.callback) req.callback(retry, DOMO_RETRY, _doc);
+    return;
+  }
+  if (req.sync) {
+    _syncRc = rc;
+    _syncDone = true;
+  }
+  else if (req.callback) req.callback(&req, rc, _doc);
+}
+
+void Domoticz::record(S_DOMOSLOT *s, int rc)
+{
+  if (s->req.tipo >= DOMO_TIPOS) return;
+  S_DOMOSTATS *st = &_stats[s->req.tipo];
+  switch (rc) {
+    case DOMO_OK:      st->ok++; break;
+    case DOMO_ERRX:    st->errx++; break;
+    case DOMO_ERRJSON: st->json++; break;
+    default:
+      if (s->httpCode > 0 && s->httpCode != 200) st->http++;
+      else st->comm++;
+  }
+  //solo las fases que la peticion llego a completar
+  if (s->fases & (1 << DOMO_T_CONNECT)) recordPhase(st, DOMO_T_CONNECT, s->start, s->tSent);
+  if (s->fases & (1 << DOMO_T_FIRSTBYTE)) recordPhase(st, DOMO_T_FIRSTBYTE, s->tSent, s->tFirst);
+  if (s->fases & (1 << DOMO_T_BODY)) recordPhase(st, DOMO_T_BODY, s->tFirst, s->tBody);
+  if (s->fases & (1 << DOMO_T_PARSE)) recordPhase(st, DOMO_T_PARSE, s->tBody, s->tParsed);
+}
+
+void Domoticz::recordPhase(S_DOMOSTATS *st, uint8_t fase, unsigned long from, unsigned long to)
+{
+  unsigned long ms = to - from;
+  uint8_t b = 0;
+  while (b < DOMO_BUCKETS - 1 && ms > bucketLimits[b]) b++;
+  if (st->hist[fase][b] < 0xFFFF) st->hist[fase][b]++;
+  if (ms > st->maxMs[fase]) st->maxMs[fase] = ms;
+  st->sumMs[fase] += ms;
+}
+
+const S_DOMOSTATS &Domoticz::stats(uint8_t tipo)
+{
+  return _stats[tipo < DOMO_TIPOS ? tipo : 0];
+}
+
+void Domoticz::resetStats()
+{
+  memset(_stats, 0, sizeof(_stats));
+}
+
+void Domoticz::printStats(Print &out)
+{
+  out.printf("Domoticz: conexiones: %lu reutilizadas: %lu en cola: %d \n", (unsigned long)_connects, (unsigned long)_reuses, pending());
+  out.printf("\t%-10s", "ms <=");
+  for (uint8_t b = 0; b < DOMO_BUCKETS - 1; b++) out.printf("%6d", bucketLimits[b]);
+  out.println(F("   mas   media    max"));
+  for (uint8_t t = 0; t < DOMO_TIPOS; t++) {
+    S_DOMOSTATS *st = &_stats[t];
+    uint32_t total = st->ok + st->comm + st->http + st->errx + st->json;
+    out.printf("%s: %lu peticiones, ok: %lu comm: %lu http: %lu errx: %lu json: %lu reintentos: %lu sustituidas: %lu \n",
+               nTipos[t], (unsigned long)total, (unsigned long)st->ok, (unsigned long)st->comm, (unsigned long)st->http,
+               (unsigned long)st->errx, (unsigned long)st->json, (unsigned long)st->retries, (unsigned long)st->superseded);
+    if (!total) continue;
+    for (uint8_t f = 0; f < DOMO_T_FASES; f++) {
+      uint32_t n = 0;
+      out.printf("\t%-10s", nFases[f]);
+      for (uint8_t b = 0; b < DOMO_BUCKETS; b++) {
+        out.printf("%6u", st->hist[f][b]);
+        n += st->hist[f][b];
+      }
+      out.printf("%8lu %6lu \n", (unsigned long)(n ? st->sumMs[f] / n : 0), (unsigned long)st->maxMs[f]);
+    }
+  }
+}
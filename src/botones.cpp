@@ -21,15 +21,68 @@
  * - initLeds(): Initializes the LED hardware and displays an initial pattern.
  * - initHC595(): Initializes the 74HC595 shift register.
  * - ledRGB(): Controls the RGB LED.
- * - led(): Controls individual LEDs.
+ * - led(): Controls individual LEDs (only in the frame ledStatus).
+ * - ledMask(): Controls a set of LEDs at once (LEDBIT masks, LEDS_ZONAS...).
+ * - ledAnim() / ledAnimStop(): Start / end a LED animation pattern.
+ * - flushLeds(): Publishes the frame for the chain writer.
+ * - ledPWM(): Sets the duty level of a LED (dimming).
+ * - initLedsPWM(): Starts the timer1 interrupt that writes the chain.
+ * - buzzer(): Switches the buzzer at once (it hangs from the same chain).
+ * - ledStatsInfo(): Shows led() calls and physical writes per second.
  * - ledStatusId(): Checks the status of a specific LED.
  * - initCD4021B(): Initializes the CD4021B shift register.
  * - shiftInCD4021B(): Reads a byte of data from the CD4021B shift register.
  * - readInputs(): Reads the state of all buttons.
- * - testButton(): Tests the state of a specific button.
- * - parseInputs(): Parses the button inputs and handles debouncing.
- * - bID_bIndex(): Gets the index of a button based on its ID.
- * - bID_zIndex(): Gets the index of a zone based on its ID.
+ * - tomaEntradas(): Takes the input snapshot of the loop (state and edges).
+ * - testButton(): Tests the state of a specific button in the snapshot.
+ * - parseInputs(): Delivers the button edges queued by the scanner.
+ * - benchLookups(): Compares bID_bIndex/bID_zIndex (Hardware.h) against the
+ *   former linear scans (DEBUG only).
+ * - benchShiftRegisters(): Compares the cost of the LED and button chains against
+ *   the former digitalWrite/shiftOut path (DEBUG only).
+ * - checkInputEvents(): Checks that every button of the chain delivers its event
+ *   through parseInputs(), alone and all at once (DEBUG only).
+ * 
+ * led() only updates the working frame ledStatus, owned by loop(); flushLeds()
+ * publishes it (one store, or a short critical section for masks wider than
+ * 32 bits) as ledFrame once per loop() and wherever a
+ * pattern is shown while blocking (signals built with delay(), the buzzer), so
+ * a half updated frame is never shown.
+ * 
+ * Blinks are entries of a pattern table (LEDs, on/off periods, repeat count,
+ * priority) kept ordered by priority. It is evaluated LEDS_ANIMHZ times per
+ * second from ledsISR(): every pattern takes the LEDs of its mask not claimed
+ * by a higher priority one and sets them on or off according to its phase, so
+ * several zones can blink at once and a pattern never needs a Ticker of its
+ * own. A pattern with repeat count ends by itself.
+ * 
+ * The only writer of the chain is ledsISR(), run by timer1 LEDS_PWMSTEPS times
+ * per PWM period (LEDS_PWMHZ). It composes ledFrame with the animations, applies
+ * the PWM mask of the current step (LEDs whose duty level is above it) and
+ * latches the result only if it differs from what is shown. Dimming thus costs
+ * no loop() time and does not depend on how busy loop() is.
+ * 
+ * ledsISR() also scans the CD4021B chain INPUTS_SCANHZ times per second and
+ * debounces all the inputs in parallel with a 2 bit vertical counter per input
+ * (an input changes after 4 equal samples). Each scan with changes pushes an
+ * event (millis(), changed inputs, new state) into a single producer / single
+ * consumer ring, so edges are not lost while loop() is blocked and simultaneous
+ * edges arrive together. parseInputs() drains it one button at a time and
+ * repeats the hold buttons while they stay pressed. Everything else (testButton,
+ * getMultiStatus) looks at the snapshot taken once per loop() by tomaEntradas(),
+ * so the bus is not read again and every decision of a loop sees the same state.
+ * readInputs() (raw read, only for the bench) disables interrupts while it
+ * clocks the CD4021B, as both chains share the clock pin.
+ * 
+ * Both chains are driven writing straight to the GPIO registers (GPOS/GPOC/GPI):
+ * one store per edge instead of a digitalWrite call. The HSPI peripheral cannot
+ * be used with this wiring: D7 (HSPI MOSI) is the CD4021B data output, D6 (HSPI
+ * MISO) its latch and the HC595 data is on D8 (HSPI CS).
+ * 
+ * The length of both chains comes from the hardware profile (Hardware.h):
+ * CD4021B_BYTES and HC595_BYTES registers, plus HC595_EXTRA registers that get
+ * a copy of the top byte. Masks are ledmask_t / inmask_t, as wide as the chain,
+ * and every transfer is a loop of one byte per register.
  * 
  * @note The file uses conditional compilation for debugging and tracing.
  * 
@@ -42,27 +95,72 @@
  */
 #include <Control.h>
 
-unsigned long lastMillis;
-#define DEBOUNCEMILLIS 20
-volatile uint16_t ledStatus = 0;
+#define DEBOUNCEMILLIS 20    // ms entre repeticiones de los botones con hold
+#define SR_HALFCLOCK    8     // ciclos de CPU de cada semiperiodo del reloj de los registros
+#define SR_SETTLE       80    // ciclos de espera (1 us a 80 MHz) antes de leer un bit del CD4021B
+#define SR_LATCH        160   // ciclos del pulso de carga paralela del CD4021B
+volatile ledmask_t ledStatus = 0;            // frame de trabajo (loop)
+volatile ledmask_t ledFrame = 0;             // frame publicado (lo lee ledsISR)
+volatile ledmask_t ledShown = 0;             // frame escrito en la cadena
+volatile ledmask_t pwmMask[LEDS_PWMSTEPS];   // LEDs encendidos en cada paso del periodo PWM
+uint8_t ledDuty[LED_BITS];                   // nivel de cada LED (0..LEDS_PWMSTEPS)
+volatile uint8_t pwmStep = 0;
+S_ANIM animTable[LEDS_ANIMSLOTS];            // patrones activos, de mayor a menor prioridad
+volatile uint32_t animFrames = 0;            // frames de animacion desde el arranque
+volatile ledmask_t animMask = 0;             // LEDs bajo el control de algun patron
+volatile ledmask_t animOn = 0;               // de ellos, los encendidos en este frame
+volatile inmask_t inputsEstable = 0;         // estado filtrado de las entradas (lo escribe ledsISR)
+inmask_t vcBit0 = ~(inmask_t)0, vcBit1 = ~(inmask_t)0;   // contadores verticales del antirrebote
+S_INPUTEV inputQueue[INPUTS_QUEUE];          // eventos de cambio de las entradas
+volatile uint8_t inputHead = 0;              // lo escribe solo ledsISR
+volatile uint8_t inputTail = 0;              // lo escribe solo parseInputs
+volatile uint32_t inputPerdidos = 0;         // eventos descartados con la cola llena
+
+static_assert((LEDS_PWMHZ * LEDS_PWMSTEPS) % LEDS_ANIMHZ == 0, "LEDS_ANIMHZ debe dividir la frecuencia de ledsISR");
+#define ANIM_TICKS   ((LEDS_PWMHZ * LEDS_PWMSTEPS) / LEDS_ANIMHZ)   // pasos de ledsISR por frame
+static_assert((LEDS_PWMHZ * LEDS_PWMSTEPS) % INPUTS_SCANHZ == 0, "INPUTS_SCANHZ debe dividir la frecuencia de ledsISR");
+#define SCAN_TICKS   ((LEDS_PWMHZ * LEDS_PWMSTEPS) / INPUTS_SCANHZ)   // pasos de ledsISR por lectura de botones
+static_assert((INPUTS_QUEUE & (INPUTS_QUEUE - 1)) == 0, "INPUTS_QUEUE debe ser potencia de 2");
+uint32_t ledCalls = 0;              // llamadas a led() (antes cada una era una escritura)
+uint32_t ledShifts = 0;             // escrituras fisicas de la cadena
+
+//los pines de ambas cadenas deben ser GPIO0..15 (registros GPOS/GPOC/GPI)
+static_assert(HC595_DATA < 16 && HC595_LATCH < 16 && HC595_CLOCK < 16, "HC595 fuera de GPIO0..15");
+static_assert(CD4021B_DATA < 16 && CD4021B_LATCH < 16 && CD4021B_CLOCK < 16, "CD4021B fuera de GPIO0..15");
+
+static inline void pinHigh(uint8_t pin) { GPOS = (1 << pin); }
+static inline void pinLow(uint8_t pin) { GPOC = (1 << pin); }
+static inline bool pinRead(uint8_t pin) { return (GPI >> pin) & 1; }
+
+static inline void esperaCiclos(uint32_t ciclos)
+{
+  uint32_t inicio = ESP.getCycleCount();
+  while (ESP.getCycleCount() - inicio < ciclos);
+}
+
+//equivalente a shiftOut(HC595_DATA, HC595_CLOCK, MSBFIRST, val)
+static void IRAM_ATTR shiftOutHC595(uint8_t val)
+{
+  for (int8_t i = 7; i >= 0; i--) {
+    (val & (1 << i)) ? pinHigh(HC595_DATA) : pinLow(HC595_DATA);
+    pinHigh(HC595_CLOCK);
+    esperaCiclos(SR_HALFCLOCK);
+    pinLow(HC595_CLOCK);
+    esperaCiclos(SR_HALFCLOCK);
+  }
+}
 
 void apagaLeds()
 {
-  digitalWrite(HC595_LATCH, LOW);
-  shiftOut(HC595_DATA, HC595_CLOCK, MSBFIRST, 0);
-  shiftOut(HC595_DATA, HC595_CLOCK, MSBFIRST, 0);
-  digitalWrite(HC595_LATCH, HIGH);
   ledStatus = 0;
+  flushLeds();
   delay(200);
 }
 
 void enciendeLeds()
 {
-  digitalWrite(HC595_LATCH, LOW);
-  shiftOut(HC595_DATA, HC595_CLOCK, MSBFIRST, 0xFF);
-  shiftOut(HC595_DATA, HC595_CLOCK, MSBFIRST, 0xFF);
-  digitalWrite(HC595_LATCH, HIGH);
-  ledStatus = 0xFFFF;
+  ledStatus = ~(ledmask_t)0;
+  flushLeds();
   delay(200);
 }
 
@@ -75,9 +173,11 @@ void loadDefaultSignal(uint veces)
   for(i=0;i<veces;i++) {
     led(LEDR,ON);
     led(LEDG,ON);
+    flushLeds();
     delay(300);
     led(LEDR,OFF);
     led(LEDG,OFF);
+    flushLeds();
     delay(300);
   }
 }
@@ -91,9 +191,11 @@ void wifiClearSignal(uint veces)
   for(i=0;i<veces;i++) {
     led(LEDR,ON);
     led(LEDB,ON);
+    flushLeds();
     delay(300);
     led(LEDR,OFF);
     led(LEDB,OFF);
+    flushLeds();
     delay(300);
   }
 }
@@ -101,13 +203,18 @@ void wifiClearSignal(uint veces)
 void initLeds()
 {
   int i;
-  uint ledOrder[] = { lZONA1 , lZONA2 , lZONA3 , lZONA4 , lZONA5 , lZONA6 , lZONA7 ,
-                      LEDR , LEDG , lGRUPO1 , lGRUPO2 , lGRUPO3 };
-  size_t numLeds = sizeof(ledOrder)/sizeof(ledOrder[0]);
+  //zonas y grupos por numero, con sus LEDs de la tabla _BOTONES (Hardware.h)
+  uint ledOrder[NUMZONAS + 2 + NUMGRUPOS];
+  size_t numLeds = 0;
+  for(i=0;i<NUMZONAS;i++) ledOrder[numLeds++] = HW_LEDS[bID_bIndex(ZONAS[i])];
+  ledOrder[numLeds++] = LEDR;
+  ledOrder[numLeds++] = LEDG;
+  for(i=0;i<NUMGRUPOS;i++) ledOrder[numLeds++] = HW_LEDS[bID_bIndex(GRUPOS[i])];
   apagaLeds();
   delay(200);
   for(i=0;i<numLeds;i++) {
     led(ledOrder[i],ON);
+    flushLeds();
     delay(300);
     led(ledOrder[i],OFF);
   }
@@ -117,6 +224,7 @@ void initLeds()
   apagaLeds();
   delay(200);
   led(LEDR,ON);
+  flushLeds();
 }
 
 void initHC595()
@@ -124,9 +232,128 @@ void initHC595()
   pinMode(HC595_CLOCK, OUTPUT);
   pinMode(HC595_DATA, OUTPUT);
   pinMode(HC595_LATCH, OUTPUT);
+  for(uint8_t i=0;i<LED_BITS;i++) ledDuty[i] = LEDS_PWMSTEPS;
+  for(uint8_t s=0;s<LEDS_PWMSTEPS;s++) pwmMask[s] = ~(ledmask_t)0;
+  ledShown = ~(ledmask_t)0;   //fuerza la primera escritura
+  initLedsPWM();
   apagaLeds();
 }
 
+void initLedsPWM()
+{
+  timer1_isr_init();
+  timer1_attachInterrupt(ledsISR);
+  timer1_enable(TIM_DIV16, TIM_EDGE, TIM_LOOP);
+  //TIM_DIV16: 5 ticks por us
+  timer1_write(5000000UL / (LEDS_PWMHZ * LEDS_PWMSTEPS));
+}
+
+//un frame de animacion: recorre la tabla (ordenada por prioridad) y compone animMask/animOn
+static void IRAM_ATTR evaluaAnim()
+{
+  uint32_t ahora = ++animFrames;
+  ledmask_t cubiertos = 0, encendidos = 0;
+  for(uint8_t i=0;i<LEDS_ANIMSLOTS;i++) {
+    S_ANIM &a = animTable[i];
+    if(!a.mask) continue;
+    uint32_t t = ahora - a.inicio;
+    uint32_t periodo = a.on + a.off;
+    if(a.repeat && t >= periodo * a.repeat) {
+      a.mask = 0;
+      continue;
+    }
+    ledmask_t m = a.mask & ~cubiertos;
+    cubiertos |= m;
+    if(t % periodo < a.on) encendidos |= m;
+  }
+  animMask = cubiertos;
+  animOn = encendidos;
+}
+
+byte shiftInCD4021B(int myDataPin, int myClockPin);
+
+//el primer byte leido es el del registro mas cercano al ESP: el mas alto de la mascara
+static inmask_t IRAM_ATTR leeCadenaCD4021B()
+{
+  inmask_t inputs = 0;
+  pinHigh(CD4021B_LATCH);
+  esperaCiclos(SR_LATCH);
+  pinLow(CD4021B_LATCH);
+  for(uint8_t b=0;b<CD4021B_BYTES;b++) inputs = (inputs << 8) | shiftInCD4021B(CD4021B_DATA, CD4021B_CLOCK);
+  return inputs;
+}
+
+//una lectura de los botones: antirrebote de todas las entradas a la vez y evento si alguna cambia
+static void IRAM_ATTR escaneaEntradas()
+{
+  inmask_t cambio = inputsEstable ^ leeCadenaCD4021B();
+  //contador de 2 bits por entrada: se recarga mientras no hay cambio y desborda a las 4 muestras
+  vcBit0 = ~(vcBit0 & cambio);
+  vcBit1 = vcBit0 ^ (vcBit1 & cambio);
+  cambio &= vcBit0 & vcBit1;
+  if(!cambio) return;
+  inputsEstable ^= cambio;
+  uint8_t head = inputHead;
+  if((uint8_t)(head - inputTail) >= INPUTS_QUEUE) {
+    inputPerdidos++;
+    return;
+  }
+  S_INPUTEV &ev = inputQueue[head & (INPUTS_QUEUE - 1)];
+  ev.ms = millis();
+  ev.cambios = cambio;
+  ev.estado = inputsEstable;
+  inputHead = head + 1;
+}
+
+//escribe un frame en la cadena; no toca ningun estado (lo usa tambien benchShiftRegisters)
+static void IRAM_ATTR escribeCadenaHC595(ledmask_t frame)
+{
+  //el primer byte llega al registro mas lejano: se escribe del mas alto al mas bajo
+  uint8_t alto = (uint8_t)(frame >> (8 * (HC595_BYTES - 1)));
+  pinLow(HC595_LATCH);
+  for(uint8_t e=0;e<HC595_EXTRA;e++) shiftOutHC595(alto);
+  for(int8_t b=HC595_BYTES-1;b>=0;b--) shiftOutHC595((uint8_t)(frame >> (8 * b)));
+  pinHigh(HC595_LATCH);
+}
+
+void IRAM_ATTR ledsISR()
+{
+  static uint8_t ticks = 0;
+  static uint8_t ticksScan = 0;
+  if(++ticks >= ANIM_TICKS) {
+    ticks = 0;
+    evaluaAnim();
+  }
+  if(++ticksScan >= SCAN_TICKS) {
+    ticksScan = 0;
+    escaneaEntradas();
+  }
+  pwmStep = (pwmStep + 1) % LEDS_PWMSTEPS;
+  ledmask_t frame = (ledFrame & ~animMask) | animOn;
+  frame &= pwmMask[pwmStep];
+  if(frame == ledShown) return;
+  escribeCadenaHC595(frame);
+  ledShown = frame;
+  ledShifts++;
+}
+
+void ledPWM(uint8_t id, uint8_t duty)
+{
+  if(id==0) return;
+  if(duty > LEDS_PWMSTEPS) duty = LEDS_PWMSTEPS;
+  if(ledDuty[id-1] == duty) return;
+  ledDuty[id-1] = duty;
+  ledmask_t mask[LEDS_PWMSTEPS];
+  for(uint8_t s=0;s<LEDS_PWMSTEPS;s++) {
+    mask[s] = 0;
+    for(uint8_t i=0;i<LED_BITS;i++) if(ledDuty[i] > s) mask[s] |= LEDBIT(i+1);
+  }
+  //la tabla se cambia entera entre dos pasos del PWM
+  noInterrupts();
+  for(uint8_t s=0;s<LEDS_PWMSTEPS;s++) pwmMask[s] = mask[s];
+  interrupts();
+}
+
 void ledRGB(int  R, int G, int B)
 {
   led(LEDR,R);
@@ -137,24 +364,111 @@ void ledRGB(int  R, int G, int B)
 void led(uint8_t id,int estado)
 {
     if(id==0) return;
-    if(estado == ON) ledStatus |= (1 << (id-1));
-    else ledStatus &= ~(1 << (id-1));
-    uint8_t bajo = (uint8_t)((ledStatus & 0x00FF));
-    uint8_t alto = (uint8_t)((ledStatus & 0xFF00) >> 8);
-    digitalWrite(HC595_LATCH, LOW);
-    shiftOut(HC595_DATA, HC595_CLOCK, MSBFIRST, alto);
-    shiftOut(HC595_DATA, HC595_CLOCK, MSBFIRST, alto);
-    shiftOut(HC595_DATA, HC595_CLOCK, MSBFIRST, bajo);
-    digitalWrite(HC595_LATCH, HIGH);
+    ledCalls++;
+    if(estado == ON) ledStatus |= LEDBIT(id);
+    else ledStatus &= ~LEDBIT(id);
+}
+
+void ledMask(ledmask_t mask, int estado)
+{
+    ledCalls++;
+    if(estado == ON) ledStatus |= mask;
+    else ledStatus &= ~mask;
+}
+
+static uint16_t msFrames(uint16_t ms)
+{
+    uint32_t frames = ((uint32_t)ms * LEDS_ANIMHZ + 500) / 1000;
+    return frames ? frames : 1;
+}
+
+//quita de los patrones de prioridad prio los LEDs de mask y compacta la tabla (con interrupciones paradas)
+static void quitaAnim(ledmask_t mask, uint8_t prio)
+{
+    uint8_t j = 0;
+    for(uint8_t i=0;i<LEDS_ANIMSLOTS;i++) {
+      S_ANIM a = animTable[i];
+      if(a.prio == prio) a.mask &= ~mask;
+      if(!a.mask) continue;
+      animTable[j++] = a;
+    }
+    for(;j<LEDS_ANIMSLOTS;j++) animTable[j].mask = 0;
+}
+
+bool ledAnim(ledmask_t mask, uint16_t onMs, uint16_t offMs, uint8_t repeat, uint8_t prio, uint16_t desfaseMs)
+{
+    if(!mask) return false;
+    S_ANIM nuevo;
+    nuevo.mask = mask;
+    nuevo.on = msFrames(onMs);
+    nuevo.off = msFrames(offMs);
+    nuevo.repeat = repeat;
+    nuevo.prio = prio;
+    noInterrupts();
+    //un LED tiene como mucho un patron de cada prioridad: el nuevo sustituye al anterior
+    quitaAnim(mask, prio);
+    uint8_t n = 0;
+    while(n < LEDS_ANIMSLOTS && animTable[n].mask) n++;
+    if(n == LEDS_ANIMSLOTS) {
+      interrupts();
+      Serial.println(F("[ERROR] ledAnim: tabla de animaciones llena"));
+      return false;
+    }
+    uint8_t pos = n;
+    while(pos > 0 && animTable[pos-1].prio < prio) {
+      animTable[pos] = animTable[pos-1];
+      pos--;
+    }
+    nuevo.inicio = animFrames - (desfaseMs ? msFrames(desfaseMs) : 0);
+    animTable[pos] = nuevo;
+    interrupts();
+    return true;
+}
+
+void ledAnimStop(uint8_t prio)
+{
+    noInterrupts();
+    quitaAnim(~(ledmask_t)0, prio);
+    interrupts();
+}
+
+void flushLeds()
+{
+    //un frame de mas de 32 bits no se publica con un solo store
+    if(sizeof(ledmask_t) > 4) {
+      noInterrupts();
+      ledFrame = ledStatus;
+      interrupts();
+    }
+    else ledFrame = ledStatus;
+}
+
+void buzzer(int estado)
+{
+    led(BUZZER,estado);
+    flushLeds();
+}
+
+void ledStatsInfo()
+{
+    static unsigned long tAnterior = 0;
+    static uint32_t callsAnterior = 0, shiftsAnterior = 0;
+    unsigned long ms = millis() - tAnterior;
+    if(ms == 0) return;
+    Serial.printf("LEDs: %lu llamadas a led() y %lu escrituras de la cadena en %lu ms \n", (unsigned long)(ledCalls - callsAnterior), (unsigned long)(ledShifts - shiftsAnterior), ms);
+    Serial.printf("\tescrituras/s: antes (una por led()) %lu, ahora %lu \n", (unsigned long)((ledCalls - callsAnterior) * 1000UL / ms), (unsigned long)((ledShifts - shiftsAnterior) * 1000UL / ms));
+    tAnterior = millis();
+    callsAnterior = ledCalls;
+    shiftsAnterior = ledShifts;
 }
 
 bool ledStatusId(int ledID)
 {
   #ifdef EXTRADEBUG
-    Serial.print(F("ledStatus : "));Serial.println(ledStatus,BIN);
+    Serial.print(F("ledStatus : "));Serial.println((unsigned long)ledStatus,BIN);
     Serial.print(F("ledID : "));Serial.println(ledID,DEC);
   #endif
-  return((ledStatus & (1 << (ledID-1))));
+  return((ledStatus & LEDBIT(ledID)) != 0);
 }
 
 void initCD4021B()
@@ -164,81 +478,252 @@ void initCD4021B()
   pinMode(CD4021B_DATA, INPUT);
 }
 
-byte shiftInCD4021B(int myDataPin, int myClockPin)
+byte IRAM_ATTR shiftInCD4021B(int myDataPin, int myClockPin)
 {
   int i;
-  int temp=0;
   int myDataIn = 0;
   for (i=7;i>=0;i--)
   {
-    digitalWrite(myClockPin,0);
-    delayMicroseconds(2);
-    temp = digitalRead(myDataPin);
-    if(temp) myDataIn = myDataIn | (1 << i);
-    digitalWrite(myClockPin,1);
+    pinLow(myClockPin);
+    esperaCiclos(SR_SETTLE);
+    if(pinRead(myDataPin)) myDataIn = myDataIn | (1 << i);
+    pinHigh(myClockPin);
   }
   return myDataIn;
 }
 
-uint16_t readInputs()
+inmask_t readInputs()
 {
-  byte    switchVar1;
-  byte    switchVar2;
-  digitalWrite(CD4021B_LATCH,1);
-  delayMicroseconds(20);
-  digitalWrite(CD4021B_LATCH,0);
-  switchVar1 = shiftInCD4021B(CD4021B_DATA, CD4021B_CLOCK);
-  switchVar2 = shiftInCD4021B(CD4021B_DATA, CD4021B_CLOCK);
-  return switchVar2 | (switchVar1 << 8);
+  //ledsISR no debe mover el reloj compartido mientras se leen los botones
+  noInterrupts();
+  inmask_t inputs = leeCadenaCD4021B();
+  interrupts();
+  return inputs;
 }
 
-bool testButton(uint16_t id,bool state)
+void tomaEntradas()
 {
-  uint16_t buttons = readInputs();
-  bool result = ((buttons & id) == 0)?0:1;
+  inmask_t nuevo;
+  //una mascara de mas de 32 bits no se lee con un solo load
+  if(sizeof(inmask_t) > 4) {
+    noInterrupts();
+    nuevo = inputsEstable;
+    interrupts();
+  }
+  else nuevo = inputsEstable;
+  entradas.estado = nuevo;
+}
+
+bool testButton(inmask_t id,bool state)
+{
+  bool result = ((entradas.estado & id) == 0)?0:1;
   if (result == state) return 1;
    else return 0;
 }
 
 S_BOTON *parseInputs(bool read)
 {
+  static inmask_t pendientes = 0;   // cambios del evento en curso aun no entregados
+  static inmask_t estadoEv = 0;
+  static unsigned long lastHold = 0;
+  static uint32_t perdidosAnterior = 0;
   int i;
-  unsigned long currentMillis = millis();
-  if(currentMillis < (lastMillis + DEBOUNCEMILLIS)) return NULL;
-  else lastMillis = currentMillis;
-  uint16_t inputs = readInputs();
-  for (i=0;i<NUM_S_BOTON;i++) {
-    if (!Boton[i].flags.enabled) continue;
-    Boton[i].estado = inputs & Boton[i].id;
-    if ((Boton[i].estado != Boton[i].ultimo_estado) || (Boton[i].estado && Boton[i].flags.hold && !Boton[i].flags.holddisabled))
-    {
+  if (inputPerdidos != perdidosAnterior) {
+    Serial.printf("[ERROR] parseInputs: %lu eventos de botones perdidos (cola llena) \n", (unsigned long)(inputPerdidos - perdidosAnterior));
+    perdidosAnterior = inputPerdidos;
+  }
+  while (true) {
+    if (!pendientes) {
+      uint8_t tail = inputTail;
+      if (tail == inputHead) break;
+      S_INPUTEV &ev = inputQueue[tail & (INPUTS_QUEUE - 1)];
+      pendientes = ev.cambios;
+      estadoEv = ev.estado;
+      #ifdef EXTRADEBUG
+        Serial.printf("evento botones: cambios %#lX estado %#lX hace %lu ms \n", (unsigned long)ev.cambios, (unsigned long)ev.estado, millis() - ev.ms);
+      #endif
+      inputTail = tail + 1;
+    }
+    for (i=0;i<NUM_S_BOTON;i++) {
+      //los pseudobotones (0xFF0n) no son un bit de la cadena: con ellos se borrarian otros pendientes
+      if (!Boton[i].flags.enabled || !hwEsBit(Boton[i].id)) continue;
+      if (!(pendientes & Boton[i].id)) continue;
+      pendientes &= ~Boton[i].id;
+      Boton[i].estado = (estadoEv & Boton[i].id) != 0;   //estado es int: un bit alto de la mascara se perderia
       Boton[i].ultimo_estado = Boton[i].estado;
       if (Boton[i].estado || Boton[i].flags.dual) {
         #ifdef DEBUG
           bool bEstado = Boton[i].estado;
           if (!read) Serial.print(F("Cleared: "));
-          Serial.printf("Boton: %s  idx: %d  id: %#X  Estado: %d \n", Boton[i].desc, Boton[i].idx, Boton[i].id, bEstado);
+          Serial.printf("Boton: %s  idx: %d  id: %#lX  Estado: %d \n", Boton[i].desc, Boton[i].idx, (unsigned long)Boton[i].id, bEstado);
         #endif
         if (read) return &Boton[i]; 
       }
     }
+    pendientes = 0;
+  }
+  //sin eventos pendientes: se repiten los botones con hold mientras siguen pulsados
+  if (millis() - lastHold < DEBOUNCEMILLIS) return NULL;
+  lastHold = millis();
+  for (i=0;i<NUM_S_BOTON;i++) {
+    if (!Boton[i].flags.enabled) continue;
+    if ((entradas.estado & Boton[i].id) && Boton[i].flags.hold && !Boton[i].flags.holddisabled) {
+      #ifdef DEBUG
+        Serial.printf("Boton: %s  idx: %d  id: %#lX  Estado: %d \n", Boton[i].desc, Boton[i].idx, (unsigned long)Boton[i].id, 1);
+      #endif
+      if (read) return &Boton[i]; 
+    }
   }
   return NULL;
 }
 
-int bID_bIndex(uint16_t id)
-{
-  for (int i=0;i<NUM_S_BOTON;i++) {
-    if (Boton[i].id == id) return i;
+#ifdef DEBUG
+  //camino anterior (digitalWrite/shiftOut), solo como referencia para benchShiftRegisters
+  static void ledBitBang(ledmask_t estado)
+  {
+    uint8_t alto = (uint8_t)(estado >> (8 * (HC595_BYTES - 1)));
+    digitalWrite(HC595_LATCH, LOW);
+    for (int e=0;e<HC595_EXTRA;e++) shiftOut(HC595_DATA, HC595_CLOCK, MSBFIRST, alto);
+    for (int b=HC595_BYTES-1;b>=0;b--) shiftOut(HC595_DATA, HC595_CLOCK, MSBFIRST, (uint8_t)(estado >> (8 * b)));
+    digitalWrite(HC595_LATCH, HIGH);
   }
-  return 999;
-}
 
-int bID_zIndex(uint16_t id)
-{
-  for (uint i=0;i<NUMZONAS;i++) {
-    if(ZONAS[i] == id) return i;
+  static inmask_t readInputsBitBang()
+  {
+    inmask_t inputs = 0;
+    digitalWrite(CD4021B_LATCH,1);
+    delayMicroseconds(20);
+    digitalWrite(CD4021B_LATCH,0);
+    for (int i=IN_BITS-1;i>=0;i--) {
+      digitalWrite(CD4021B_CLOCK,0);
+      delayMicroseconds(2);
+      if(digitalRead(CD4021B_DATA)) inputs |= ((inmask_t)1 << i);
+      digitalWrite(CD4021B_CLOCK,1);
+    }
+    return inputs;
   }
-  return 999;
-}
 
+  void benchShiftRegisters()
+  {
+    const int N = 100;
+    uint32_t t0, cLed, cLedBB, cIn, cInBB;
+    inmask_t in = 0, inBB = 0;
+    const int bytesLed = HC595_BYTES + HC595_EXTRA;
+    uint8_t id = HW_LEDS[bID_bIndex(ZONAS[0])];
+    bool estado = ledStatusId(id);
+    //ambos caminos escriben la cadena por su cuenta: ledsISR se para durante la medida.
+    //No se llama a ledsISR desde aqui: avanzaria animaciones, antirrebote y cola de eventos
+    timer1_disable();
+    t0 = ESP.getCycleCount();
+    for (int i = 0; i < N; i++) ledBitBang(ledStatus);
+    cLedBB = (ESP.getCycleCount() - t0) / N;
+    t0 = ESP.getCycleCount();
+    for (int i = 0; i < N; i++) {
+      led(id, !estado);
+      led(id, estado);
+      flushLeds();
+      escribeCadenaHC595(ledFrame);
+    }
+    cLed = (ESP.getCycleCount() - t0) / N;
+    ledShown = ~(ledmask_t)0;   //fuerza que ledsISR reescriba su frame al volver
+    t0 = ESP.getCycleCount();
+    for (int i = 0; i < N; i++) inBB = readInputsBitBang();
+    cInBB = (ESP.getCycleCount() - t0) / N;
+    initLedsPWM();
+    t0 = ESP.getCycleCount();
+    for (int i = 0; i < N; i++) in = readInputs();
+    cIn = (ESP.getCycleCount() - t0) / N;
+    Serial.printf("BENCH registros (%d llamadas, %d MHz): ciclos/llamada \n", N, ESP.getCpuFreqMHz());
+    Serial.printf("\tled()        : %6lu (antes %6lu) %lu us, %lu ciclos/byte (%d bytes) \n", (unsigned long)cLed, (unsigned long)cLedBB, (unsigned long)(cLed / ESP.getCpuFreqMHz()), (unsigned long)(cLed / bytesLed), bytesLed);
+    Serial.printf("\treadInputs() : %6lu (antes %6lu) %lu us, %lu ciclos/byte (%d bytes) \n", (unsigned long)cIn, (unsigned long)cInBB, (unsigned long)(cIn / ESP.getCpuFreqMHz()), (unsigned long)(cIn / CD4021B_BYTES), CD4021B_BYTES);
+    if (in != inBB) Serial.printf("[ERROR] readInputs() 0x%lx distinto del camino anterior 0x%lx \n", (unsigned long)in, (unsigned long)inBB);
+  }
+
+  //busquedas anteriores (recorrido lineal), solo como referencia para benchLookups
+  static int bIndexLineal(inmask_t id)
+  {
+    for (int i=0;i<NUM_S_BOTON;i++) {
+      if (Boton[i].id == id) return i;
+    }
+    return 999;
+  }
+
+  static int zIndexLineal(inmask_t id)
+  {
+    for (uint i=0;i<NUMZONAS;i++) {
+      if(ZONAS[i] == id) return i;
+    }
+    return 999;
+  }
+
+  void benchLookups()
+  {
+    const int N = 100;
+    uint32_t t0, cB, cBL, cZ, cZL;
+    volatile int suma = 0;
+    int errores = 0;
+    for (int i = 0; i < NUM_S_BOTON; i++) if (bID_bIndex(Boton[i].id) != bIndexLineal(Boton[i].id)) errores++;
+    for (int i = 0; i < NUMZONAS; i++) if (bID_zIndex(ZONAS[i]) != zIndexLineal(ZONAS[i])) errores++;
+    t0 = ESP.getCycleCount();
+    for (int n = 0; n < N; n++) for (int i = 0; i < NUM_S_BOTON; i++) suma += bIndexLineal(Boton[i].id);
+    cBL = (ESP.getCycleCount() - t0) / (N * NUM_S_BOTON);
+    t0 = ESP.getCycleCount();
+    for (int n = 0; n < N; n++) for (int i = 0; i < NUM_S_BOTON; i++) suma += bID_bIndex(Boton[i].id);
+    cB = (ESP.getCycleCount() - t0) / (N * NUM_S_BOTON);
+    t0 = ESP.getCycleCount();
+    for (int n = 0; n < N; n++) for (int i = 0; i < NUMZONAS; i++) suma += zIndexLineal(ZONAS[i]);
+    cZL = (ESP.getCycleCount() - t0) / (N * NUMZONAS);
+    t0 = ESP.getCycleCount();
+    for (int n = 0; n < N; n++) for (int i = 0; i < NUMZONAS; i++) suma += bID_zIndex(ZONAS[i]);
+    cZ = (ESP.getCycleCount() - t0) / (N * NUMZONAS);
+    Serial.printf("BENCH busquedas (%d rondas de todos los ID): ciclos/llamada \n", N);
+    Serial.printf("\tbID_bIndex() : %4lu (antes %4lu) \n", (unsigned long)cB, (unsigned long)cBL);
+    Serial.printf("\tbID_zIndex() : %4lu (antes %4lu) \n", (unsigned long)cZ, (unsigned long)cZL);
+    if (errores) Serial.printf("[ERROR] benchLookups: %d indices distintos de la busqueda lineal \n", errores);
+  }
+
+  //encola un evento como lo haria escaneaEntradas (solo con ledsISR parado)
+  static void encolaEvento(inmask_t cambios, inmask_t estado)
+  {
+    S_INPUTEV &ev = inputQueue[inputHead & (INPUTS_QUEUE - 1)];
+    ev.ms = millis();
+    ev.cambios = cambios;
+    ev.estado = estado;
+    inputHead = inputHead + 1;
+  }
+
+  void checkInputEvents()
+  {
+    int errores = 0, probados = 0;
+    inmask_t todos = 0, entregados = 0;
+    S_BOTON *boton;
+    //los eventos se inyectan en la cola: ledsISR (su productor) se para durante la prueba
+    timer1_disable();
+    parseInputs(CLEAR);
+    for (int i = 0; i < NUM_S_BOTON; i++) {
+      if (!Boton[i].flags.enabled || !hwEsBit(Boton[i].id)) continue;
+      todos |= Boton[i].id;
+      probados++;
+      encolaEvento(Boton[i].id, Boton[i].id);
+      boton = parseInputs(READ);
+      if (boton != &Boton[i]) {
+        Serial.printf("[ERROR] checkInputEvents: pulsar %s entrega %s \n", Boton[i].desc, boton ? boton->desc : "nada");
+        errores++;
+      }
+      encolaEvento(Boton[i].id, 0);
+      parseInputs(CLEAR);
+    }
+    //todos a la vez en un mismo evento: cada boton se entrega una vez
+    encolaEvento(todos, todos);
+    for (int n = 0; n < NUM_S_BOTON && (boton = parseInputs(READ)) != NULL; n++) entregados |= boton->id;
+    if (entregados != todos) {
+      Serial.printf("[ERROR] checkInputEvents: pulsacion simultanea entrega %#lX de %#lX \n", (unsigned long)entregados, (unsigned long)todos);
+      errores++;
+    }
+    encolaEvento(todos, 0);
+    parseInputs(CLEAR);
+    for (int i = 0; i < NUM_S_BOTON; i++) Boton[i].estado = Boton[i].ultimo_estado = (entradas.estado & Boton[i].id) != 0;
+    initLedsPWM();
+    Serial.printf("CHECK eventos de botones: %d botones, %d errores \n", probados, errores);
+  }
+#endif
@@ -9,9 +9,9 @@
  * on LEDs, and print multi-group configurations for debugging purposes.
  *
  * The functions provided are:
- * - uint16_t getMultiStatus(): Returns the status of the multi-group based on button states.
- * - int setMultibyId(uint16_t id, Config_parm &cfg): Sets the multi-group configuration based on the given ID.
- * - void displayGrupo(uint16_t *serie, int serieSize): Displays the group information using LEDs.
+ * - inmask_t getMultiStatus(): Returns the status of the multi-group based on button states.
+ * - int setMultibyId(inmask_t id, Config_parm &cfg): Sets the multi-group configuration based on the given ID.
+ * - void displayGrupo(inmask_t *serie, int serieSize): Displays the group information using LEDs.
  * - void printMultiGroup(Config_parm &cfg, int pgrupo): Prints the configuration of the specified group for debugging.
  *
  * @note This file is part of the ControlRiego-2.5 project.
@@ -23,17 +23,17 @@
  */
 #include "Control.h"
 
-uint16_t getMultiStatus()
+inmask_t getMultiStatus()
 {
-  if (Boton[bID_bIndex(bGRUPO1)].estado) return bGRUPO1;
-  if (Boton[bID_bIndex(bGRUPO3)].estado) return bGRUPO3;
+  if (entradas.estado & bGRUPO1) return bGRUPO1;
+  if (entradas.estado & bGRUPO3) return bGRUPO3;
   return bGRUPO2  ;
 }
 
-int setMultibyId(uint16_t id, Config_parm &cfg)
+int setMultibyId(inmask_t id, Config_parm &cfg)
 {
   #ifdef TRACE
-    Serial.printf("TRACE: in setMultibyId - recibe id=x%x \n", id);
+    Serial.printf("TRACE: in setMultibyId - recibe id=x%lx \n", (unsigned long)id);
   #endif
   for(int i=0; i<NUMGRUPOS; i++)
   {
@@ -42,6 +42,7 @@ int setMultibyId(uint16_t id, Config_parm &cfg)
       multi.size = &cfg.groupConfig[i].size;
       multi.zserie = &cfg.groupConfig[i].serie[0];
       multi.desc = cfg.groupConfig[i].desc;
+      multi.idx = &cfg.groupConfig[i].idx;
       for (int j=0; j < *multi.size; j++) {
         multi.serie[j] = ZONAS[cfg.groupConfig[i].serie[j]-1];  
         #ifdef EXTRADEBUG 
@@ -56,15 +57,17 @@ int setMultibyId(uint16_t id, Config_parm &cfg)
   return 0;
 }
 
-void displayGrupo(uint16_t *serie, int serieSize)
+void displayGrupo(inmask_t *serie, int serieSize)
 {
   led(Boton[bID_bIndex(*multi.id)].led,ON);
   int i;
   for(i=0;i<serieSize;i++) {
     led(Boton[bID_bIndex(serie[i])].led,ON);
+    flushLeds();
     delay(300);
     bip(i+1);
     led(Boton[bID_bIndex(serie[i])].led,OFF);
+    flushLeds();
     delay(100);
   }
   led(Boton[bID_bIndex(*multi.id)].led,OFF);
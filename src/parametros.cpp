@@ -34,6 +34,11 @@
  */
 #include "Control.h"
 
+//tamaños que crecen con el numero de zonas del perfil (2048/1536/2048 con 7 zonas)
+#define CFG_FILEMAX   (768 + 192 * NUMZONAS)   // tamaño maximo del fichero de configuracion
+#define CFG_LOADDOC   (384 + 168 * NUMZONAS)   // jsondoc de loadConfigFile
+#define CFG_SAVEDOC   (640 + 208 * NUMZONAS)   // jsondoc de saveConfigFile
+
 bool loadConfigFile(const char *p_filename, Config_parm &cfg)
 {
   #ifdef TRACE
@@ -50,13 +55,13 @@ bool loadConfigFile(const char *p_filename, Config_parm &cfg)
     return false;
   }
   size_t size = file.size();
-  if (size > 2048) {
+  if (size > CFG_FILEMAX) {
     Serial.println(F("Config file size is too large"));
     return false;
   }
   Serial.printf("\t tamaño de %s --> %d bytes \n", p_filename, size);
 
-  DynamicJsonDocument doc(1536);
+  DynamicJsonDocument doc(CFG_LOADDOC);
   DeserializationError error = deserializeJson(doc, file);
 
   if (error) {
@@ -73,6 +78,10 @@ bool loadConfigFile(const char *p_filename, Config_parm &cfg)
   }  
   for (JsonObject botones_item : doc["botones"].as<JsonArray>()) {
     int i = botones_item["zona"] | 1; 
+    if (i < 1 || i > cfg.n_Zonas) {
+      Serial.printf("[ERROR] zona %d fuera de rango (1..%d) \n", i, cfg.n_Zonas);
+      return false;
+    }
     cfg.botonConfig[i-1].idx = botones_item["idx"] | 0;
     strlcpy(cfg.botonConfig[i-1].desc, botones_item["nombre"] | "", sizeof(cfg.botonConfig[i-1].desc));
     i++;
@@ -80,8 +89,13 @@ bool loadConfigFile(const char *p_filename, Config_parm &cfg)
   //--------------  procesa parametro individuales   --------------
   cfg.minutes = doc["tiempo"]["minutos"] | 0; // 0
   cfg.seconds = doc["tiempo"]["segundos"] | 10; // 10
+  cfg.solape = doc["tiempo"]["solape"] | 0;
   strlcpy(cfg.domoticz_ip, doc["domoticz"]["ip"] | "", sizeof(cfg.domoticz_ip));
   strlcpy(cfg.domoticz_port, doc["domoticz"]["port"] | "", sizeof(cfg.domoticz_port));
+  cfg.shadowMaxAge = doc["domoticz"]["shadowmaxage"] | SHADOW_MAXAGE;
+  cfg.mqtt = doc["domoticz"]["mqtt"] | false;
+  strlcpy(cfg.mqtt_ip, doc["domoticz"]["mqtt_ip"] | "", sizeof(cfg.mqtt_ip));
+  strlcpy(cfg.mqtt_port, doc["domoticz"]["mqtt_port"] | "1883", sizeof(cfg.mqtt_port));
   strlcpy(cfg.ntpServer, doc["ntpServer"] | "", sizeof(cfg.ntpServer));
   int numgroups = doc["numgroups"] | 1;
   if (numgroups != cfg.n_Grupos) {
@@ -91,6 +105,10 @@ bool loadConfigFile(const char *p_filename, Config_parm &cfg)
   //--------------  procesa grupos  --------------
   for (JsonObject groups_item : doc["grupos"].as<JsonArray>()) {
     int i = groups_item["grupo"] | 1; 
+    if (i < 1 || i > cfg.n_Grupos) {
+      Serial.printf("[ERROR] grupo %d fuera de rango (1..%d) \n", i, cfg.n_Grupos);
+      return false;
+    }
     cfg.groupConfig[i-1].id = GRUPOS[i-1];  
     cfg.groupConfig[i-1].size = groups_item["size"] | 1;
     if (cfg.groupConfig[i-1].size == 0) {
@@ -98,15 +116,21 @@ bool loadConfigFile(const char *p_filename, Config_parm &cfg)
       Serial.println(F("ERROR tamaño del grupo incorrecto, es 0 -> ponemos 1"));
     }
     strlcpy(cfg.groupConfig[i-1].desc, groups_item["desc"] | "", sizeof(cfg.groupConfig[i-1].desc)); 
+    cfg.groupConfig[i-1].idx = groups_item["idx"] | 0;
     JsonArray array = groups_item["zonas"].as<JsonArray>();
     int count = array.size();
-    if (count != cfg.groupConfig[i-1].size) {
+    if (count != cfg.groupConfig[i-1].size || count > cfg.n_Zonas) {
       Serial.println(F("ERROR tamaño del grupo incorrecto"));
       return false;
     }  
     int j = 0;
     for(JsonVariant zonas_item_elemento : array) {
-      cfg.groupConfig[i-1].serie[j] = zonas_item_elemento.as<int>();
+      int zona = zonas_item_elemento.as<int>();
+      if (zona < 1 || zona > cfg.n_Zonas) {
+        Serial.printf("[ERROR] grupo %d: zona %d fuera de rango (1..%d) \n", i, zona, cfg.n_Zonas);
+        return false;
+      }
+      cfg.groupConfig[i-1].serie[j] = zona;
       j++;
     }
     i++;
@@ -133,7 +157,7 @@ bool saveConfigFile(const char *p_filename, Config_parm &cfg)
     Serial.println(F("Failed to open file for writing"));
     return false;
   }
-  DynamicJsonDocument doc(2048);
+  DynamicJsonDocument doc(CFG_SAVEDOC);
   //--------------  procesa botones (IDX)  --------------
   doc["numzonas"] = NUMZONAS;
   doc["botones"].as<JsonArray>();
@@ -146,8 +170,13 @@ bool saveConfigFile(const char *p_filename, Config_parm &cfg)
   //--------------  procesa parametro individuales   --------------
   doc["tiempo"]["minutos"]  = cfg.minutes; 
   doc["tiempo"]["segundos"] = cfg.seconds;
+  doc["tiempo"]["solape"]   = cfg.solape;
   doc["domoticz"]["ip"]     = cfg.domoticz_ip;
   doc["domoticz"]["port"]   = cfg.domoticz_port;
+  doc["domoticz"]["shadowmaxage"] = cfg.shadowMaxAge;
+  doc["domoticz"]["mqtt"]   = cfg.mqtt;
+  doc["domoticz"]["mqtt_ip"] = cfg.mqtt_ip;
+  doc["domoticz"]["mqtt_port"] = cfg.mqtt_port;
   doc["ntpServer"]          = cfg.ntpServer;
   //--------------  procesa grupos  --------------
   doc["numgroups"]          = NUMGRUPOS;
@@ -156,6 +185,7 @@ bool saveConfigFile(const char *p_filename, Config_parm &cfg)
     array_grupos[i]["grupo"]   = i+1;
     array_grupos[i]["desc"]    = cfg.groupConfig[i].desc;
     array_grupos[i]["size"]    = cfg.groupConfig[i].size;
+    array_grupos[i]["idx"]     = cfg.groupConfig[i].idx;
     JsonArray array_zonas = array_grupos[i].createNestedArray("zonas");
     for(int j=0; j<cfg.groupConfig[i].size; j++) {
       array_zonas[j] = cfg.groupConfig[i].serie[j];
@@ -234,17 +264,19 @@ void printParms(Config_parm &cfg) {
   //--------------  imprime array botones (IDX)  --------------
   Serial.printf("\tnumzonas= %d \n", cfg.n_Zonas);
   Serial.println(F("\tBotones: "));
-  for(int i=0; i<7; i++) {
+  for(int i=0; i<NUMZONAS; i++) {
     Serial.printf("\t\t Zona%d: IDX=%d (%s) l=%d \n", i+1, cfg.botonConfig[i].idx, cfg.botonConfig[i].desc, sizeof(cfg.botonConfig[i].desc));
   }
   //--------------  imprime parametro individuales   --------------
-  Serial.printf("\tminutes= %d seconds= %d \n", cfg.minutes, cfg.seconds);
+  Serial.printf("\tminutes= %d seconds= %d solape= %d \n", cfg.minutes, cfg.seconds, cfg.solape);
   Serial.printf("\tdomoticz_ip= %s domoticz_port= %s \n", cfg.domoticz_ip, cfg.domoticz_port);
+  Serial.printf("\tshadowMaxAge= %d \n", cfg.shadowMaxAge);
+  Serial.printf("\tmqtt= %d mqtt_ip= %s mqtt_port= %s \n", cfg.mqtt, cfg.mqtt_ip, cfg.mqtt_port);
   Serial.printf("\tntpServer= %s \n", cfg.ntpServer);
   Serial.printf("\tnumgroups= %d \n", cfg.n_Grupos);
   //--------------  imprime array y subarray de grupos  --------------
   for(int i = 0; i < cfg.n_Grupos; i++) {
-    Serial.printf("\tGrupo%d: size=%d (%s)\n", i+1, cfg.groupConfig[i].size, cfg.groupConfig[i].desc);
+    Serial.printf("\tGrupo%d: size=%d idx=%d (%s)\n", i+1, cfg.groupConfig[i].size, cfg.groupConfig[i].idx, cfg.groupConfig[i].desc);
     for(int j = 0; j < cfg.groupConfig[i].size; j++) {
       Serial.printf("\t\t Zona%d \n", cfg.groupConfig[i].serie[j]);
     }
@@ -8,6 +8,12 @@
  * - Listing files in the filesystem.
  * - Providing system information.
  * - Handling file uploads and deletions.
+ * - An always listening notification endpoint (port 8081) through which Domoticz
+ *   tells of the changes of the zone switches: /notify?idx=<idx>&state=On|Off
+ *   (e.g. in the "On Action" / "Off Action" of each device). The endpoint is not
+ *   authenticated, so the state is not trusted: the notification only makes the
+ *   controller ask Domoticz for the zone in course. The same port serves
+ *   /domostats, the counters and latencies of the requests to Domoticz.
  * 
  * The web server is built using the ESP8266WebServer library and utilizes the LittleFS filesystem.
  * It also includes an HTTP update server for firmware updates.
@@ -31,6 +37,7 @@
    #include "Control.h"
    
    #include "builtinfiles.h"
+   #include <StreamString.h>
 
    #define UNUSED __attribute__((unused))
 
@@ -43,6 +50,8 @@
    const char* update_password = "admin";
 
    ESP8266WebServer wserver(wsport);
+   int nsport = 8081;
+   ESP8266WebServer nserver(nsport);   // avisos de Domoticz, siempre activo
    ESP8266HTTPUpdateServer httpUpdater;
    String TS2Date(time_t t)
    {
@@ -230,6 +239,35 @@
       wserver.handleClient();
       MDNS.update();
    }  
+   void handleNotify() {
+      //state se admite por compatibilidad con las acciones ya configuradas, pero no se usa
+      uint16_t idx = nserver.arg("idx").toInt();
+      if (idx == 0) {
+         nserver.send(400, "text/plain", "uso: /notify?idx=<idx>&state=On|Off\n");
+         return;
+      }
+      nserver.send(200, "text/plain", "OK\n");
+      procesaAviso(idx);
+   }
+   void handleDomoStats() {
+      StreamString stats;
+      domoticz->printStats(stats);
+      nserver.send(200, "text/plain", stats);
+   }
+   void setupNotify()
+   {
+      nserver.on("/notify", HTTP_GET, handleNotify);
+      nserver.on("/domostats", HTTP_GET, handleDomoStats);
+      nserver.onNotFound([]() {
+         nserver.send(404, "text/plain", "");
+      });
+      nserver.begin();
+      Serial.printf("[WS] avisos de Domoticz en http://%s:%d/notify?idx=<idx>&state=On|Off \n", WiFi.localIP().toString().c_str(), nsport);
+   }
+   void procesaNotify()
+   {
+      nserver.handleClient();
+   }
    void endWS()
    {
       TRACE2("cerrando filesystem...\n");
@@ -18,14 +18,10 @@
  * @date 2024
  * 
  * @see WiFiManager
- * @see Ticker
  */
 #include "Control.h"
 
 
-Ticker tic_WifiLed;
-Ticker tic_APLed;
-
 int timeout = 180;  
 WiFiManager wm;
 
@@ -33,29 +29,19 @@ WiFiManagerParameter custom_domoticz_server("domoticz_ip", "Domoticz_ip");
 WiFiManagerParameter custom_domoticz_port("domoticz_port", "puerto");
 WiFiManagerParameter custom_ntpserver("ntpServer", "NTP_server");
 
-void parpadeoLedWifi(){
-  byte estado = ledStatusId(LEDG);
-  led(LEDG,!estado);
-}
-
-void parpadeoLedAP(){
-  byte estado = ledStatusId(LEDB);
-  led(LEDB,!estado);
-}
-
 void saveWifiCallback() {
   Serial.println(F("[CALLBACK] saveWifiCallback fired"));
-    tic_APLed.detach();
+    ledAnimStop(ANIM_AP);
     led(LEDB,OFF);
     infoDisplay("----", NOBLINK, BIP, 0);
-    tic_WifiLed.attach(0.2, parpadeoLedWifi);
+    ledAnim(LEDBIT(LEDG), 200, 200, 0, ANIM_WIFI);
 }
 
 void configModeCallback (WiFiManager *myWiFiManager) {
   Serial.println(F("[CALLBACK] configModeCallback fired"));
-  tic_WifiLed.detach();
+  ledAnimStop(ANIM_WIFI);
   led(LEDG,OFF);
-  tic_APLed.attach(0.5, parpadeoLedAP);
+  ledAnim(LEDBIT(LEDB), 500, 500, 0, ANIM_AP);
   infoDisplay("-AP-", DEFAULTBLINK, LONGBIP, 1); 
 }
 
@@ -87,7 +73,7 @@ void setupRedWM(Config_parm &config)
   wm.setHostname(HOSTNAME); 
   // Descomentar para resetear configuración
   //wm.resetSettings();
-  tic_WifiLed.attach(0.2, parpadeoLedWifi);
+  ledAnim(LEDBIT(LEDG), 200, 200, 0, ANIM_WIFI);
   wm.setConfigPortalTimeout(timeout);
   wm.setAPCallback(configModeCallback);
   wm.setSaveConfigCallback(saveWifiCallback);
@@ -108,13 +94,13 @@ void setupRedWM(Config_parm &config)
     delay(1000);
   }
 
-  tic_APLed.detach();
+  ledAnimStop(ANIM_AP);
   infoDisplay("----", NOBLINK, BIP, 0);
   if (falloAP && wm.getWiFiIsSaved()) {
     Serial.println(F("Hay wifi salvada -> reintentamos la conexion"));
     int j=0;
     falloAP = false;
-    tic_WifiLed.attach(0.2, parpadeoLedWifi);
+    ledAnim(LEDBIT(LEDG), 200, 200, 0, ANIM_WIFI);
     while(WiFi.status() != WL_CONNECTED) {
       Serial.print(F("."));
       delay(2000);
@@ -127,7 +113,7 @@ void setupRedWM(Config_parm &config)
     }
   }
   NONETWORK ? led(LEDB,ON) : led(LEDB,OFF);
-  tic_WifiLed.detach();
+  ledAnimStop(ANIM_WIFI);
   if (checkWifi()) {
     Serial.printf("\nWifi conectado a SSID: %s\n", WiFi.SSID().c_str());
     Serial.print(F(" IP address: "));
@@ -153,10 +139,10 @@ void starConfigPortal(Config_parm &config)
     strcpy(config.domoticz_port, custom_domoticz_port.getValue());
     strcpy(config.ntpServer, custom_ntpserver.getValue());
   }
-  tic_APLed.detach();
+  ledAnimStop(ANIM_AP);
   NONETWORK ? led(LEDB,ON) : led(LEDB,OFF);
   infoDisplay("----", NOBLINK, BIP, 0);
-  tic_WifiLed.detach();
+  ledAnimStop(ANIM_WIFI);
   checkWifi();
 }
 
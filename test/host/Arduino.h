@@ -0,0 +1,145 @@
+/**
+ * @file Arduino.h
+ * @brief Minimal Arduino core for the host (native) tests.
+ *
+ * Only what the modules built on the host (Domoticz, DomoMqtt) and their
+ * libraries use: millis() from the monotonic clock, Print/Stream, Serial on
+ * stdout and the PROGMEM helpers of the ESP8266 core, which on the host read
+ * plain RAM.
+ *
+ * @note This file is part of the ControlRiego-2.5 project.
+ */
+
+#ifndef Arduino_h
+#define Arduino_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+
+using std::min;
+using std::max;
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define PROGMEM
+#define PSTR(s)               (s)
+#define F(s)                  ((const __FlashStringHelper *)(s))
+#define IRAM_ATTR
+#define snprintf_P            snprintf
+#define sprintf_P             sprintf
+#define strncasecmp_P         strncasecmp
+
+class __FlashStringHelper;
+
+inline unsigned long millis(void)
+{
+  static struct timespec inicio = {0, 0};
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  if (!inicio.tv_sec && !inicio.tv_nsec) inicio = t;
+  return (unsigned long)((t.tv_sec - inicio.tv_sec) * 1000 + (t.tv_nsec - inicio.tv_nsec) / 1000000);
+}
+
+inline unsigned long micros(void)
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (unsigned long)(t.tv_sec * 1000000 + t.tv_nsec / 1000);
+}
+
+inline void delay(unsigned long ms) { usleep(ms * 1000); }
+inline void yield(void) {}
+inline long random(long howbig) { return howbig ? ::random() % howbig : 0; }
+inline long random(long howsmall, long howbig) { return howsmall + random(howbig - howsmall); }
+
+//la glibc del host no la trae
+inline size_t strlcpy(char *dst, const char *src, size_t size)
+{
+  size_t len = strlen(src);
+  if (size) {
+    size_t n = (len < size - 1) ? len : size - 1;
+    memcpy(dst, src, n);
+    dst[n] = '\0';
+  }
+  return len;
+}
+
+class Print
+{
+  public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t *buffer, size_t size)
+    {
+      size_t n = 0;
+      while (size--) n += write(*buffer++);
+      return n;
+    }
+    size_t write(const char *str) { return write((const uint8_t *)str, strlen(str)); }
+    size_t print(const char *str) { return write(str); }
+    size_t print(const __FlashStringHelper *str) { return write((const char *)str); }
+    size_t print(char c) { return write((uint8_t)c); }
+    size_t print(long n) { return printf("%ld", n); }
+    size_t print(unsigned long n) { return printf("%lu", n); }
+    size_t print(int n) { return print((long)n); }
+    size_t print(unsigned int n) { return print((unsigned long)n); }
+    size_t println(void) { return write("\r\n"); }
+    template <typename T> size_t println(T value) { size_t n = print(value); return n + println(); }
+    size_t printf(const char *format, ...) __attribute__((format(printf, 2, 3)))
+    {
+      char buf[256];
+      va_list args;
+      va_start(args, format);
+      int n = vsnprintf(buf, sizeof(buf), format, args);
+      va_end(args);
+      if (n < 0) return 0;
+      return write((const uint8_t *)buf, min((size_t)n, sizeof(buf) - 1));
+    }
+    virtual void flush(void) {}
+};
+
+class Stream : public Print
+{
+  protected:
+    unsigned long _timeout = 1000;
+
+  public:
+    virtual int available(void) = 0;
+    virtual int read(void) = 0;
+    virtual int peek(void) = 0;
+    void setTimeout(unsigned long timeout) { _timeout = timeout; }
+    unsigned long getTimeout(void) { return _timeout; }
+};
+
+class HardwareSerial : public Stream
+{
+  public:
+    void begin(unsigned long) {}
+    size_t write(uint8_t c) override { return fwrite(&c, 1, 1, stdout); }
+    size_t write(const uint8_t *buffer, size_t size) override { return fwrite(buffer, 1, size, stdout); }
+    int available(void) override { return 0; }
+    int read(void) override { return -1; }
+    int peek(void) override { return -1; }
+    using Print::write;
+};
+
+inline HardwareSerial Serial;
+
+class EspClass
+{
+  public:
+    uint32_t getChipId(void) { return (uint32_t)getpid() & 0xFFFFFF; }
+};
+
+inline EspClass ESP;
+
+#endif // Arduino_h
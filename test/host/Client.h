@@ -0,0 +1,31 @@
+/**
+ * @file Client.h
+ * @brief Arduino Client interface for the host (native) tests.
+ *
+ * @note This file is part of the ControlRiego-2.5 project.
+ */
+
+#ifndef Client_h
+#define Client_h
+
+#include <Arduino.h>
+#include <IPAddress.h>
+
+class Client : public Stream
+{
+  public:
+    virtual int connect(IPAddress ip, uint16_t port) = 0;
+    virtual int connect(const char *host, uint16_t port) = 0;
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t *buffer, size_t size) = 0;
+    virtual int available(void) = 0;
+    virtual int read(void) = 0;
+    virtual int read(uint8_t *buffer, size_t size) = 0;
+    virtual int peek(void) = 0;
+    virtual void flush(void) = 0;
+    virtual void stop(void) = 0;
+    virtual uint8_t connected(void) = 0;
+    virtual operator bool(void) = 0;
+};
+
+#endif // Client_h
@@ -0,0 +1,156 @@
+/**
+ * @file ESP8266WiFi.h
+ * @brief WiFiClient over the POSIX sockets of the host (native) tests.
+ *
+ * Behaves like the ESP8266 one where the firmware relies on it: connect()
+ * blocks up to the timeout of the Stream, available()/read()/peek() never
+ * wait, and connected() stays true while there are received bytes to read.
+ * WiFi.status() is always WL_CONNECTED.
+ *
+ * @note This file is part of the ControlRiego-2.5 project.
+ */
+
+#ifndef ESP8266WiFi_h
+#define ESP8266WiFi_h
+
+#include <Arduino.h>
+#include <IPAddress.h>
+#include <Client.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+#define WL_CONNECTED  3
+
+class WiFiClient : public Client
+{
+  private:
+    int _fd = -1; ///< Socket, -1 if closed.
+
+  public:
+    WiFiClient(void) {}
+    WiFiClient(const WiFiClient &) = delete;
+    WiFiClient &operator=(const WiFiClient &) = delete;
+    ~WiFiClient() { stop(); }
+
+    int connect(IPAddress ip, uint16_t port) override
+    {
+      stop();
+      struct sockaddr_in addr = {};
+      addr.sin_family = AF_INET;
+      addr.sin_port = htons(port);
+      addr.sin_addr.s_addr = (uint32_t)ip;
+      _fd = socket(AF_INET, SOCK_STREAM, 0);
+      if (_fd < 0) return 0;
+      fcntl(_fd, F_SETFL, fcntl(_fd, F_GETFL) | O_NONBLOCK);
+      if (::connect(_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        struct pollfd p = {_fd, POLLOUT, 0};
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (errno != EINPROGRESS || poll(&p, 1, _timeout) != 1 ||
+            getsockopt(_fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) {
+          stop();
+          return 0;
+        }
+      }
+      return 1;
+    }
+
+    int connect(const char *host, uint16_t port) override
+    {
+      IPAddress ip;
+      if (!ip.fromString(host)) {
+        struct addrinfo hints = {}, *res;
+        hints.ai_family = AF_INET;
+        if (getaddrinfo(host, NULL, &hints, &res)) return 0;
+        ip = IPAddress(((struct sockaddr_in *)res->ai_addr)->sin_addr.s_addr);
+        freeaddrinfo(res);
+      }
+      return connect(ip, port);
+    }
+
+    size_t write(uint8_t c) override { return write(&c, 1); }
+
+    size_t write(const uint8_t *buffer, size_t size) override
+    {
+      size_t sent = 0;
+      while (_fd >= 0 && sent < size) {
+        ssize_t n = send(_fd, buffer + sent, size - sent, MSG_NOSIGNAL);
+        if (n > 0) sent += n;
+        else if (n < 0 && errno == EAGAIN) {
+          struct pollfd p = {_fd, POLLOUT, 0};
+          if (poll(&p, 1, _timeout) != 1) break;
+        }
+        else break;
+      }
+      return sent;
+    }
+
+    int available(void) override
+    {
+      int n = 0;
+      if (_fd < 0 || ioctl(_fd, FIONREAD, &n) < 0) return 0;
+      return n;
+    }
+
+    int read(void) override
+    {
+      uint8_t c;
+      return (read(&c, 1) == 1) ? c : -1;
+    }
+
+    int read(uint8_t *buffer, size_t size) override
+    {
+      if (_fd < 0) return -1;
+      ssize_t n = recv(_fd, buffer, size, MSG_DONTWAIT);
+      return (n > 0) ? (int)n : -1;
+    }
+
+    int peek(void) override
+    {
+      uint8_t c;
+      if (_fd < 0 || recv(_fd, &c, 1, MSG_DONTWAIT | MSG_PEEK) != 1) return -1;
+      return c;
+    }
+
+    void flush(void) override {}
+
+    void stop(void) override
+    {
+      if (_fd >= 0) close(_fd);
+      _fd = -1;
+    }
+
+    uint8_t connected(void) override
+    {
+      uint8_t c;
+      if (_fd < 0) return 0;
+      ssize_t n = recv(_fd, &c, 1, MSG_DONTWAIT | MSG_PEEK);
+      return (n > 0 || (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)));
+    }
+
+    operator bool(void) override { return connected(); }
+
+    void setNoDelay(bool nodelay)
+    {
+      int on = nodelay;
+      if (_fd >= 0) setsockopt(_fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+
+    using Print::write;
+};
+
+class ESP8266WiFiClass
+{
+  public:
+    int status(void) { return WL_CONNECTED; }
+};
+
+inline ESP8266WiFiClass WiFi;
+
+#endif // ESP8266WiFi_h
@@ -0,0 +1,230 @@
+/**
+ * @file FakeDomoticz.h
+ * @brief Local HTTP server that answers like Domoticz, for the host tests.
+ *
+ * The server listens on 127.0.0.1 (on a port chosen by the system) from its
+ * own thread and serves every connection from another one, keeping it open
+ * between requests as Domoticz does. The answer to each request is built by a
+ * handler of the test from the path, together with the latency to inject: ms
+ * before the headers, and size and spacing of the pieces the body is sent in.
+ *
+ * domoDispositivo() and domoRespuesta() build bodies with the layout of
+ * json.htm?type=devices of Domoticz (pretty printed, all the fields of a
+ * light switch), so the tests parse answers of the real size.
+ *
+ * @note This file is part of the ControlRiego-2.5 project.
+ */
+
+#ifndef FakeDomoticz_h
+#define FakeDomoticz_h
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+//respuesta del servidor a una peticion
+struct S_FAKERESPUESTA {
+  std::string body;
+  int code = 200;
+  unsigned long delayMs = 0;  // ms antes de enviar las cabeceras
+  size_t chunk = 0;           // bytes de cada trozo del cuerpo (0: todo de una vez)
+  unsigned long chunkMs = 0;  // ms entre trozos
+  bool cuelga = false;        // no responde nunca
+  bool cierra = false;        // cierra la conexion tras responder
+};
+
+typedef std::function<S_FAKERESPUESTA(const std::string &path)> fakeHandler;
+
+class FakeDomoticz
+{
+  private:
+    int _fd; ///< Listening socket.
+    uint16_t _port; ///< Port chosen by the system.
+    fakeHandler _handler; ///< Builds the answer to every request.
+    std::atomic<bool> _stop; ///< The server is closing.
+    std::atomic<int> _requests; ///< Requests received.
+    std::atomic<int> _connections; ///< Connections accepted.
+    std::thread _thread; ///< Accepts the connections.
+    std::vector<std::thread> _clients; ///< One per connection.
+    std::vector<int> _fds; ///< Sockets of the connections.
+    std::mutex _mutex; ///< Protects _clients and _fds.
+
+    //espera ms sin dejar de atender el cierre del servidor
+    bool espera(unsigned long ms)
+    {
+      while (ms && !_stop) {
+        unsigned long paso = (ms < 5) ? ms : 5;
+        usleep(paso * 1000);
+        ms -= paso;
+      }
+      return !_stop;
+    }
+
+    bool envia(int fd, const char *data, size_t len)
+    {
+      while (len) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n <= 0) return false;
+        data += n;
+        len -= n;
+      }
+      return true;
+    }
+
+    void acepta(void)
+    {
+      while (!_stop) {
+        struct pollfd p = {_fd, POLLIN, 0};
+        if (poll(&p, 1, 20) != 1) continue;
+        int fd = accept(_fd, NULL, NULL);
+        if (fd < 0) continue;
+        //cabeceras y cuerpo salen sin esperar al ACK del segmento anterior
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        _connections++;
+        std::lock_guard<std::mutex> lock(_mutex);
+        _fds.push_back(fd);
+        _clients.emplace_back(&FakeDomoticz::atiende, this, fd);
+      }
+    }
+
+    void atiende(int fd)
+    {
+      std::string entrada;
+      char buf[512];
+      while (!_stop) {
+        size_t fin = entrada.find("\r\n\r\n");
+        if (fin == std::string::npos) {
+          struct pollfd p = {fd, POLLIN, 0};
+          if (poll(&p, 1, 20) != 1) continue;
+          ssize_t n = recv(fd, buf, sizeof(buf), 0);
+          if (n <= 0) break;
+          entrada.append(buf, n);
+          continue;
+        }
+        //GET <path> HTTP/1.1
+        size_t desde = entrada.find(' ') + 1;
+        std::string path = entrada.substr(desde, entrada.find(' ', desde) - desde);
+        entrada.erase(0, fin + 4);
+        _requests++;
+        S_FAKERESPUESTA r = _handler(path);
+        if (r.cuelga) {
+          while (espera(20)) {}
+          break;
+        }
+        if (!espera(r.delayMs)) break;
+        char cabeceras[160];
+        int n = snprintf(cabeceras, sizeof(cabeceras), "HTTP/1.1 %d %s\r\nContent-Length: %zu\r\nContent-Type: application/json;charset=UTF-8\r\nConnection: %s\r\n\r\n",
+                         r.code, (r.code == 200) ? "OK" : "Error", r.body.size(), r.cierra ? "close" : "keep-alive");
+        if (!envia(fd, cabeceras, n)) break;
+        size_t trozo = r.chunk ? r.chunk : r.body.size();
+        bool ok = true;
+        for (size_t i = 0; ok && i < r.body.size(); i += trozo) {
+          if (i && !espera(r.chunkMs)) ok = false;
+          else ok = envia(fd, r.body.data() + i, std::min(trozo, r.body.size() - i));
+        }
+        if (!ok || r.cierra) break;
+      }
+      shutdown(fd, SHUT_RDWR);
+    }
+
+  public:
+    FakeDomoticz(fakeHandler handler) : _handler(handler), _stop(false), _requests(0), _connections(0)
+    {
+      struct sockaddr_in addr = {};
+      socklen_t len = sizeof(addr);
+      int on = 1;
+      addr.sin_family = AF_INET;
+      addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+      _fd = socket(AF_INET, SOCK_STREAM, 0);
+      setsockopt(_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+      bind(_fd, (struct sockaddr *)&addr, sizeof(addr));
+      listen(_fd, 8);
+      getsockname(_fd, (struct sockaddr *)&addr, &len);
+      _port = ntohs(addr.sin_port);
+      _thread = std::thread(&FakeDomoticz::acepta, this);
+    }
+
+    ~FakeDomoticz()
+    {
+      _stop = true;
+      _thread.join();
+      for (std::thread &t : _clients) t.join();
+      for (int fd : _fds) close(fd);
+      close(_fd);
+    }
+
+    /**
+     * @brief Port the server listens on, as the text Domoticz::setServer() takes.
+     */
+    std::string port(void) { return std::to_string(_port); }
+
+    /**
+     * @brief Number of requests received.
+     */
+    int requests(void) { return _requests; }
+
+    /**
+     * @brief Number of connections accepted.
+     */
+    int connections(void) { return _connections; }
+};
+
+/**
+ * @brief Element of result of json.htm?type=devices for a light switch.
+ * @param idx Domoticz idx.
+ * @param name Name of the device.
+ * @param desc Description (the irrigation factor).
+ * @param status "On" or "Off".
+ */
+inline std::string domoDispositivo(int idx, const char *name, const char *desc, const char *status)
+{
+  char buf[1600];
+  snprintf(buf, sizeof(buf),
+    "\t\t{\n"
+    "\t\t\t\"AddjMulti\" : 1.0,\n\t\t\t\"AddjMulti2\" : 1.0,\n\t\t\t\"AddjValue\" : 0.0,\n\t\t\t\"AddjValue2\" : 0.0,\n"
+    "\t\t\t\"BatteryLevel\" : 255,\n\t\t\t\"CustomImage\" : 0,\n\t\t\t\"Data\" : \"%s\",\n"
+    "\t\t\t\"Description\" : \"%s\",\n\t\t\t\"DimmerType\" : \"none\",\n\t\t\t\"Favorite\" : 1,\n"
+    "\t\t\t\"HardwareDisabled\" : false,\n\t\t\t\"HardwareID\" : 3,\n\t\t\t\"HardwareName\" : \"Riego\",\n"
+    "\t\t\t\"HardwareType\" : \"Dummy (Does nothing, use for virtual switches only)\",\n\t\t\t\"HardwareTypeVal\" : 15,\n"
+    "\t\t\t\"HaveDimmer\" : false,\n\t\t\t\"HaveGroupCmd\" : false,\n\t\t\t\"HaveTimeout\" : false,\n\t\t\t\"ID\" : \"000140%02X\",\n"
+    "\t\t\t\"Image\" : \"Light\",\n\t\t\t\"IsSubDevice\" : false,\n\t\t\t\"LastUpdate\" : \"2024-06-10 18:32:07\",\n"
+    "\t\t\t\"Level\" : 0,\n\t\t\t\"LevelInt\" : 0,\n\t\t\t\"MaxDimLevel\" : 100,\n\t\t\t\"Name\" : \"%s\",\n"
+    "\t\t\t\"Notifications\" : \"false\",\n\t\t\t\"PlanID\" : \"0\",\n\t\t\t\"PlanIDs\" : \n\t\t\t[\n\t\t\t\t0\n\t\t\t],\n"
+    "\t\t\t\"Protected\" : false,\n\t\t\t\"ShowNotifications\" : true,\n\t\t\t\"SignalLevel\" : \"-\",\n"
+    "\t\t\t\"Status\" : \"%s\",\n\t\t\t\"StrParam1\" : \"\",\n\t\t\t\"StrParam2\" : \"\",\n\t\t\t\"SubType\" : \"Switch\",\n"
+    "\t\t\t\"SwitchType\" : \"On/Off\",\n\t\t\t\"SwitchTypeVal\" : 0,\n\t\t\t\"Timers\" : \"false\",\n\t\t\t\"Type\" : \"Light/Switch\",\n"
+    "\t\t\t\"TypeImg\" : \"lightbulb\",\n\t\t\t\"Unit\" : 1,\n\t\t\t\"Used\" : 1,\n\t\t\t\"UsedByCamera\" : false,\n"
+    "\t\t\t\"XOffset\" : \"0\",\n\t\t\t\"YOffset\" : \"0\",\n\t\t\t\"idx\" : \"%d\"\n"
+    "\t\t}",
+    status, desc, idx, name, status, idx);
+  return buf;
+}
+
+/**
+ * @brief Whole answer of json.htm?type=devices.
+ * @param items Elements of result, joined (empty: no result, as Domoticz when nothing matches).
+ * @param status "OK" or "ERR".
+ */
+inline std::string domoRespuesta(const std::string &items, const char *status = "OK")
+{
+  std::string r =
+    "{\n\t\"ActTime\" : 1718037127,\n\t\"AstrTwilightEnd\" : \"23:47\",\n\t\"AstrTwilightStart\" : \"04:53\",\n"
+    "\t\"CivTwilightEnd\" : \"22:36\",\n\t\"CivTwilightStart\" : \"06:04\",\n\t\"DayLength\" : \"15:10\",\n"
+    "\t\"NautTwilightEnd\" : \"23:09\",\n\t\"NautTwilightStart\" : \"05:31\",\n\t\"ServerTime\" : \"2024-06-10 18:32:07\",\n"
+    "\t\"SunAtSouth\" : \"14:20\",\n\t\"Sunrise\" : \"06:45\",\n\t\"Sunset\" : \"21:55\",\n\t\"app_version\" : \"2024.4\",\n";
+  if (items.size()) r += "\t\"result\" : \n\t[\n" + items + "\n\t],\n";
+  r += std::string("\t\"status\" : \"") + status + "\",\n\t\"title\" : \"Devices\"\n}\n";
+  return r;
+}
+
+#endif // FakeDomoticz_h
@@ -0,0 +1,34 @@
+/**
+ * @file IPAddress.h
+ * @brief IPv4 address for the host (native) tests.
+ *
+ * @note This file is part of the ControlRiego-2.5 project.
+ */
+
+#ifndef IPAddress_h
+#define IPAddress_h
+
+#include <Arduino.h>
+#include <arpa/inet.h>
+
+class IPAddress
+{
+  private:
+    uint32_t _address; ///< Network byte order, 0 if not set.
+
+  public:
+    IPAddress(void) : _address(0) {}
+    IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) : _address(htonl((uint32_t)a << 24 | (uint32_t)b << 16 | (uint32_t)c << 8 | d)) {}
+    explicit IPAddress(uint32_t address) : _address(address) {}
+    bool fromString(const char *address)
+    {
+      struct in_addr addr;
+      if (inet_pton(AF_INET, address, &addr) != 1) return false;
+      _address = addr.s_addr;
+      return true;
+    }
+    bool isSet(void) const { return _address != 0; }
+    operator uint32_t(void) const { return _address; }
+};
+
+#endif // IPAddress_h
@@ -0,0 +1,7 @@
+/**
+ * @file Stream.h
+ * @brief Stream is part of the host Arduino.h; kept for the libraries that include it.
+ *
+ * @note This file is part of the ControlRiego-2.5 project.
+ */
+#include <Arduino.h>
@@ -0,0 +1,153 @@
+/**
+ * @file test_main.cpp
+ * @brief Time of a loop() iteration while the Domoticz engine talks to a slow server.
+ *
+ * The engine runs against FakeDomoticz, which injects the latencies seen with
+ * a loaded Domoticz: status answers that take SLOW_MS to come, a device list
+ * of LIST_DEVICES full devices sent in pieces of LIST_CHUNK bytes every
+ * LIST_CHUNKMS ms, and a request that is never answered. Meanwhile the test
+ * turns a loop() like the firmware's (service() plus new requests every
+ * LOOP_REQUESTMS ms) and times every iteration.
+ *
+ * The requests have to take the injected time (or end by timeout) and no
+ * iteration may last more than LOOP_MAXMS. The result is printed as a
+ * histogram of iteration times.
+ *
+ * Run with: pio test -e native -f test_domoticz_latency
+ *
+ * @note This file is part of the ControlRiego-2.5 project.
+ */
+#include <unity.h>
+#include <FakeDomoticz.h>
+#include "../../src/Domoticz.cpp"
+
+#define LOOP_MAXMS        20    // peor iteracion de loop() admitida
+#define LOOP_RUNMS        8000  // duracion de la prueba (mas que DOMO_TIMEOUT)
+#define LOOP_REQUESTMS    250   // una consulta de estado cada tantos ms
+#define SLOW_MS           300   // lo que tarda Domoticz en responder a una consulta
+#define LIST_DEVICES      40    // dispositivos de la lista
+#define LIST_CHUNK        200   // bytes de cada trozo de la lista
+#define LIST_CHUNKMS      15    // ms entre trozos de la lista
+
+static const uint16_t loopLimits[] = {1, 2, 5, 10, 20, 50, 100, 1000};
+#define LOOP_BUCKETS  (sizeof(loopLimits) / sizeof(loopLimits[0]) + 1)
+
+static int statusOk, statusErr, items, listRc, hungRc;
+static unsigned long statusMaxMs, listMs;
+static unsigned long tStatus[DOMO_QUEUE * 4];
+static unsigned long tList;
+
+static S_FAKERESPUESTA responde(const std::string &path)
+{
+  S_FAKERESPUESTA r;
+  if (path.find("filter=light") != std::string::npos) {
+    std::string lista;
+    for (int i = 1; i <= LIST_DEVICES; i++) {
+      char name[20];
+      snprintf(name, sizeof(name), "Zona %d", i);
+      if (i > 1) lista += ",\n";
+      lista += domoDispositivo(i, name, "100", (i % 3) ? "Off" : "On");
+    }
+    r.body = domoRespuesta(lista);
+    r.chunk = LIST_CHUNK;
+    r.chunkMs = LIST_CHUNKMS;
+  }
+  else if (path.find("rid=999") != std::string::npos) r.cuelga = true;
+  else {
+    int idx = atoi(path.c_str() + path.find("rid=") + 4);
+    r.body = domoRespuesta(domoDispositivo(idx, "Zona", "100", "On"));
+    r.delayMs = SLOW_MS;
+  }
+  return r;
+}
+
+static void statusCallback(S_DOMOREQ *req, int rc, JsonDocument &doc)
+{
+  unsigned long ms = millis() - tStatus[req->idx % (DOMO_QUEUE * 4)];
+  if (ms > statusMaxMs) statusMaxMs = ms;
+  if (rc == DOMO_OK && strcmp(doc["result"][0]["Status"] | "", "On") == 0) statusOk++;
+  else statusErr++;
+}
+
+static void listCallback(S_DOMOREQ *req, int rc, JsonDocument &doc)
+{
+  if (rc == DOMO_ITEM) {
+    items++;
+    return;
+  }
+  listRc = rc;
+  listMs = millis() - tList;
+}
+
+static void hungCallback(S_DOMOREQ *req, int rc, JsonDocument &doc)
+{
+  hungRc = rc;
+}
+
+void setUp(void) {}
+void tearDown(void) {}
+
+void test_loop_time_bounded_with_slow_domoticz(void)
+{
+  FakeDomoticz server(responde);
+  Domoticz domoticz("127.0.0.1", server.port().c_str());
+  uint32_t hist[LOOP_BUCKETS] = {0};
+  unsigned long maxUs = 0, iteraciones = 0, sumUs = 0;
+  int enviadas = 0;
+  char path[DOMO_PATHSIZE];
+  statusOk = statusErr = items = 0;
+  listRc = hungRc = -1;
+  statusMaxMs = 0;
+
+  tList = millis();
+  TEST_ASSERT_TRUE(domoticz.request(DOMO_URL_LIGHTS, DOMO_FACTORS, 0, listCallback));
+  snprintf(path, sizeof(path), DOMO_URL_DEVICE, 999);
+  TEST_ASSERT_TRUE(domoticz.request(path, DOMO_STATUS, 999, hungCallback));
+  unsigned long inicio = millis(), proxima = inicio;
+  while (millis() - inicio < LOOP_RUNMS || domoticz.pending()) {
+    unsigned long t0 = micros();
+    if (millis() - inicio < LOOP_RUNMS - DOMO_TIMEOUT && (long)(millis() - proxima) >= 0) {
+      proxima += LOOP_REQUESTMS;
+      uint16_t idx = 1 + enviadas % (DOMO_QUEUE * 4 - 1);
+      snprintf(path, sizeof(path), DOMO_URL_DEVICE, idx);
+      if (domoticz.request(path, DOMO_STATUS, idx, statusCallback)) {
+        tStatus[idx] = millis();
+        enviadas++;
+      }
+    }
+    domoticz.service();
+    unsigned long us = micros() - t0;
+    uint8_t b = 0;
+    while (b < LOOP_BUCKETS - 1 && us > loopLimits[b] * 1000UL) b++;
+    hist[b]++;
+    if (us > maxUs) maxUs = us;
+    sumUs += us;
+    iteraciones++;
+    usleep(200);
+  }
+
+  printf("\nloop(): %lu iteraciones, media %lu us, peor %lu us (limite %d ms)\n", iteraciones, sumUs / iteraciones, maxUs, LOOP_MAXMS);
+  printf("  ms <=");
+  for (uint8_t b = 0; b < LOOP_BUCKETS - 1; b++) printf("%8u", loopLimits[b]);
+  printf("     mas\n        ");
+  for (uint8_t b = 0; b < LOOP_BUCKETS; b++) printf("%8u", hist[b]);
+  printf("\nconsultas: %d enviadas, %d ok, %d error, la mas lenta %lu ms\n", enviadas, statusOk, statusErr, statusMaxMs);
+  printf("lista de %d dispositivos: %d elementos en %lu ms\n", LIST_DEVICES, items, listMs);
+  printf("conexiones: %d, peticiones: %d\n", server.connections(), server.requests());
+  domoticz.printStats(Serial);
+
+  TEST_ASSERT_LESS_OR_EQUAL_MESSAGE(LOOP_MAXMS * 1000UL, maxUs, "una iteracion de loop() ha esperado a Domoticz");
+  TEST_ASSERT_EQUAL_MESSAGE(enviadas, statusOk, "consultas de estado sin respuesta correcta");
+  TEST_ASSERT_GREATER_OR_EQUAL(SLOW_MS, statusMaxMs);
+  TEST_ASSERT_EQUAL(DOMO_OK, listRc);
+  TEST_ASSERT_EQUAL(LIST_DEVICES, items);
+  TEST_ASSERT_GREATER_THAN(LIST_CHUNKMS * 10, listMs);
+  TEST_ASSERT_EQUAL(DOMO_ERR2, hungRc);
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_loop_time_bounded_with_slow_domoticz);
+  return UNITY_END();
+}
@@ -0,0 +1,176 @@
+/**
+ * @file test_main.cpp
+ * @brief Parse of Domoticz responses by the engine, with the memory each one takes.
+ *
+ * Every sample response (json.htm answers with the layout and size of
+ * Domoticz's) is served by FakeDomoticz and read by the engine as in the
+ * firmware. The test checks the result and the fields the controller uses,
+ * and prints for each response its size, the bytes of the JSON document used
+ * and the heap allocated while it was read and parsed (operator new of this
+ * thread), next to the fixed RAM of the body reader of a slot.
+ *
+ * Run with: pio test -e native -f test_domoticz_responses
+ *
+ * @note This file is part of the ControlRiego-2.5 project.
+ */
+#include <unity.h>
+#include <new>
+#include <FakeDomoticz.h>
+#include "../../src/Domoticz.cpp"
+
+//muestra de respuesta y lo que el motor debe sacar de ella
+struct S_CASO {
+  const char *nombre;
+  std::string body;
+  int code;
+  uint8_t tipo;
+  int rc;             // resultado esperado
+  int items;          // elementos esperados (listas)
+  const char *status; // Status del primer resultado (NULL: sin resultado)
+  const char *name;   // Name del primer resultado (NULL: no se comprueba)
+  const char *desc;   // Description del primer resultado (NULL: no se comprueba)
+};
+
+static thread_local bool contando;
+static size_t heapBytes;
+
+void *operator new(size_t size)
+{
+  if (contando) heapBytes += size;
+  void *p = malloc(size);
+  if (!p) throw std::bad_alloc();
+  return p;
+}
+
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+static S_CASO *caso;
+static bool terminado;
+static int rcFinal, items;
+static size_t docBytes;
+static char status[DOMO_VALUESIZE + 1], name[DOMO_VALUESIZE + 1], desc[DOMO_VALUESIZE + 1];
+static bool conResultado;
+
+static std::string lista(int n, const char *prefijo)
+{
+  std::string r;
+  for (int i = 1; i <= n; i++) {
+    char nombre[24], factor[12];
+    snprintf(nombre, sizeof(nombre), "%s %d", prefijo, i);
+    snprintf(factor, sizeof(factor), "%d", 50 + i * 5);
+    if (i > 1) r += ",\n";
+    r += domoDispositivo(i, nombre, factor, (i % 2) ? "Off" : "On");
+  }
+  return r;
+}
+
+static std::string escena(int idx, const char *name, const char *status)
+{
+  char buf[400];
+  snprintf(buf, sizeof(buf),
+    "\t\t{\n\t\t\t\"Description\" : \"\",\n\t\t\t\"Favorite\" : 1,\n\t\t\t\"LastUpdate\" : \"2024-06-10 07:00:12\",\n"
+    "\t\t\t\"Name\" : \"%s\",\n\t\t\t\"OffAction\" : \"\",\n\t\t\t\"OnAction\" : \"\",\n\t\t\t\"Protected\" : false,\n"
+    "\t\t\t\"Status\" : \"%s\",\n\t\t\t\"Timers\" : \"false\",\n\t\t\t\"Type\" : \"Group\",\n\t\t\t\"UsedByCamera\" : false,\n"
+    "\t\t\t\"idx\" : \"%d\"\n\t\t}", name, status, idx);
+  return buf;
+}
+
+static S_CASO casos[] = {
+  {"estado de una zona", domoRespuesta(domoDispositivo(23, "C\xc3\xa9sped norte", "85", "On")), 200, DOMO_STATUS, DOMO_OK, 0, "On", "C\xc3\xa9sped norte", "85"},
+  {"estado sin cambios (lastupdate)", domoRespuesta(""), 200, DOMO_STATUS, DOMO_OK, 0, NULL, NULL, NULL},
+  {"nombre y descripcion largos", domoRespuesta(domoDispositivo(7, "Goteo \\\"macetas\\\" terraza \\u00f1 este y oeste", "120\\nregar al amanecer, no con viento", "Off")), 200,
+   DOMO_FACTOR, DOMO_OK, 0, "Off", "Goteo \"macetas\" terraz", "120\nregar al amanecer, "},
+  {"orden aceptada", "{\n\t\"status\" : \"OK\",\n\t\"title\" : \"SwitchLight\"\n}\n", 200, DOMO_SWITCH, DOMO_OK, 0, NULL, NULL, NULL},
+  {"orden rechazada", "{\n\t\"message\" : \"Error sending switch command, check device/hardware (idx=35) !\",\n\t\"status\" : \"ERR\",\n\t\"title\" : \"SwitchLight\"\n}\n", 200,
+   DOMO_SWITCH, DOMO_ERRX, 0, NULL, NULL, NULL},
+  {"lista de 7 zonas", domoRespuesta(lista(7, "Zona")), 200, DOMO_FACTORS, DOMO_OK, 7, "Off", "Zona 1", "55"},
+  {"lista de 60 dispositivos", domoRespuesta(lista(60, "Luz")), 200, DOMO_FACTORS, DOMO_OK, 60, "Off", "Luz 1", "55"},
+  {"lista sin result (ninguna luz)", domoRespuesta(""), 200, DOMO_FACTORS, DOMO_OK, 0, NULL, NULL, NULL},
+  {"lista con result vacio", "{\n\t\"ActTime\" : 1718037127,\n\t\"result\" : [],\n\t\"status\" : \"OK\",\n\t\"title\" : \"Devices\"\n}\n", 200,
+   DOMO_FACTORS, DOMO_OK, 0, NULL, NULL, NULL},
+  {"lista rechazada", "{\n\t\"status\" : \"ERR\",\n\t\"title\" : \"Devices\"\n}\n", 200, DOMO_FACTORS, DOMO_ERRX, 0, NULL, NULL, NULL},
+  {"escenas", "{\n\t\"ActTime\" : 1718037127,\n\t\"result\" : \n\t[\n" + escena(3, "Grupo 1", "Off") + ",\n" + escena(4, "Grupo 2", "Mixed") +
+   "\n\t],\n\t\"status\" : \"OK\",\n\t\"title\" : \"Scenes\"\n}\n", 200, DOMO_SCENES, DOMO_OK, 2, "Off", "Grupo 1", NULL},
+  {"pagina HTML", "<html><head><title>Domoticz</title></head><body>Unauthorized</body></html>\n", 200, DOMO_STATUS, DOMO_ERRJSON, 0, NULL, NULL, NULL},
+  {"respuesta cortada", domoRespuesta(domoDispositivo(5, "Zona 5", "100", "On")).substr(0, 700), 200, DOMO_STATUS, DOMO_ERRJSON, 0, NULL, NULL, NULL},
+  {"HTTP 401", "", 401, DOMO_STATUS, DOMO_ERR2, 0, NULL, NULL, NULL},
+};
+
+static void guarda(JsonDocument &doc, JsonVariant item)
+{
+  strlcpy(status, item["Status"] | "", sizeof(status));
+  strlcpy(name, item["Name"] | "", sizeof(name));
+  strlcpy(desc, item["Description"] | "", sizeof(desc));
+  conResultado = true;
+  if (doc.memoryUsage() > docBytes) docBytes = doc.memoryUsage();
+}
+
+static void callback(S_DOMOREQ *req, int rc, JsonDocument &doc)
+{
+  if (rc == DOMO_ITEM) {
+    if (!items++) guarda(doc, doc);
+    else if (doc.memoryUsage() > docBytes) docBytes = doc.memoryUsage();
+    return;
+  }
+  if (rc == DOMO_OK && !doc["result"][0].isNull()) guarda(doc, doc["result"][0]);
+  if (doc.memoryUsage() > docBytes) docBytes = doc.memoryUsage();
+  rcFinal = rc;
+  terminado = true;
+}
+
+static S_FAKERESPUESTA responde(const std::string &path)
+{
+  S_FAKERESPUESTA r;
+  r.body = caso->body;
+  r.code = caso->code;
+  return r;
+}
+
+void setUp(void) {}
+void tearDown(void) {}
+
+void test_sample_responses(void)
+{
+  FakeDomoticz server(responde);
+  Domoticz domoticz("127.0.0.1", server.port().c_str());
+  printf("\n%-32s %7s %4s %6s %9s %6s\n", "respuesta", "bytes", "rc", "items", "jsondoc", "heap");
+  for (S_CASO &c : casos) {
+    caso = &c;
+    terminado = false;
+    items = 0;
+    docBytes = 0;
+    heapBytes = 0;
+    conResultado = false;
+    status[0] = name[0] = desc[0] = '\0';
+    TEST_ASSERT_TRUE(domoticz.request("/json.htm?type=devices&rid=1", c.tipo, 1, callback));
+    unsigned long inicio = millis();
+    while (!terminado && millis() - inicio < DOMO_TIMEOUT + 1000) {
+      contando = true;
+      domoticz.service();
+      contando = false;
+      usleep(100);
+    }
+    printf("%-32s %7zu %4d %6d %9zu %6zu\n", c.nombre, c.body.size(), rcFinal, items, docBytes, heapBytes);
+    char msg[64];
+    snprintf(msg, sizeof(msg), "respuesta: %s", c.nombre);
+    TEST_ASSERT_TRUE_MESSAGE(terminado, msg);
+    TEST_ASSERT_EQUAL_MESSAGE(c.rc, rcFinal, msg);
+    TEST_ASSERT_EQUAL_MESSAGE(c.items, items, msg);
+    TEST_ASSERT_EQUAL_MESSAGE(c.status != NULL, conResultado, msg);
+    if (c.status) TEST_ASSERT_EQUAL_STRING_MESSAGE(c.status, status, msg);
+    if (c.name) TEST_ASSERT_EQUAL_STRING_MESSAGE(c.name, name, msg);
+    if (c.desc) TEST_ASSERT_EQUAL_STRING_MESSAGE(c.desc, desc, msg);
+    TEST_ASSERT_LESS_OR_EQUAL_MESSAGE(DOMO_DOCSIZE, docBytes, msg);
+    TEST_ASSERT_EQUAL_MESSAGE(0, heapBytes, msg);
+  }
+  printf("RAM fija del lector de cuerpos: %zu bytes por slot, %d slots; documento JSON: %d bytes\n",
+         sizeof(S_DOMOSCAN), DOMO_SLOTS, DOMO_DOCSIZE);
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_sample_responses);
+  return UNITY_END();
+}
@@ -0,0 +1,99 @@
+/**
+ * @file test_main.cpp
+ * @brief bID_bIndex() and bID_zIndex() against the former linear scans.
+ *
+ * The tables of Hardware.h are compared with the scans they replaced (over
+ * the same button list) for every ID the input mask can hold, the
+ * pseudo-buttons and some values that are not IDs. Then both ways are timed
+ * over the IDs of the profile and the ns per call are printed; on the board
+ * the same comparison in cycles is benchLookups() (DEBUG).
+ *
+ * Run with: pio test -e native -f test_hw_lookup
+ *
+ * @note This file is part of the ControlRiego-2.5 project.
+ */
+#include <unity.h>
+#include <Hardware.h>
+
+#define BENCH_RONDAS  200000  // rondas de todos los ID del perfil
+
+//busquedas anteriores (recorrido lineal de la lista de botones y de ZONAS)
+static int bIndexLineal(inmask_t id)
+{
+  for (int i = 0; i < NUM_HW_BOTONES; i++) {
+    if (HW_IDS[i] == id) return i;
+  }
+  return 999;
+}
+
+static int zIndexLineal(inmask_t id)
+{
+  for (int i = 0; i < NUMZONAS; i++) {
+    if (ZONAS[i] == id) return i;
+  }
+  return 999;
+}
+
+//ns por llamada de f sobre los ID de la lista (leidos de memoria: no se evaluan al compilar)
+template <typename F> static double mide(F f, const volatile inmask_t *ids, int n)
+{
+  volatile int suma = 0;
+  unsigned long t0 = micros();
+  for (int r = 0; r < BENCH_RONDAS; r++) for (int i = 0; i < n; i++) suma += f(ids[i]);
+  return (micros() - t0) * 1000.0 / ((double)BENCH_RONDAS * n);
+}
+
+void setUp(void) {}
+void tearDown(void) {}
+
+void test_tables_match_linear_scans(void)
+{
+  int probados = 0;
+  //todos los valores de una mascara de 16 bits; en las mas anchas, cada bit y sus vecinos
+  if (IN_BITS == 16) {
+    for (uint32_t v = 0; v <= 0xFFFF; v++) {
+      inmask_t id = (inmask_t)v;
+      TEST_ASSERT_EQUAL(bIndexLineal(id), bID_bIndex(id));
+      TEST_ASSERT_EQUAL(zIndexLineal(id), bID_zIndex(id));
+      probados++;
+    }
+  }
+  else {
+    for (int b = 0; b < IN_BITS; b++) {
+      inmask_t bit = (inmask_t)1 << b;
+      inmask_t ids[] = {bit, (inmask_t)(bit | 1), (inmask_t)(bit - 1), (inmask_t)(bit | 0xFF00)};
+      for (inmask_t id : ids) {
+        TEST_ASSERT_EQUAL(bIndexLineal(id), bID_bIndex(id));
+        TEST_ASSERT_EQUAL(zIndexLineal(id), bID_zIndex(id));
+        probados++;
+      }
+    }
+  }
+  for (inmask_t p = 0xFF00; p <= 0xFF0F; p++) {
+    TEST_ASSERT_EQUAL(bIndexLineal(p), bID_bIndex(p));
+    probados++;
+  }
+  printf("\n%d ID comprobados (%d botones, %d zonas, mascara de %d bits)\n", probados, NUM_HW_BOTONES, NUMZONAS, IN_BITS);
+}
+
+void test_lookup_bench(void)
+{
+  static volatile inmask_t botones[NUM_HW_BOTONES], zonas[NUMZONAS];
+  for (int i = 0; i < NUM_HW_BOTONES; i++) botones[i] = HW_IDS[i];
+  for (int i = 0; i < NUMZONAS; i++) zonas[i] = ZONAS[i];
+  double bL = mide(bIndexLineal, botones, NUM_HW_BOTONES);
+  double b = mide(bID_bIndex, botones, NUM_HW_BOTONES);
+  double zL = mide(zIndexLineal, zonas, NUMZONAS);
+  double z = mide(bID_zIndex, zonas, NUMZONAS);
+  printf("busquedas (%d rondas de todos los ID): ns/llamada\n", BENCH_RONDAS);
+  printf("\tbID_bIndex() : %6.2f (antes %6.2f)\n", b, bL);
+  printf("\tbID_zIndex() : %6.2f (antes %6.2f)\n", z, zL);
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_tables_match_linear_scans);
+  RUN_TEST(test_lookup_bench);
+  return UNITY_END();
+}